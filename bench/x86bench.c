@@ -0,0 +1,321 @@
+/* x86bench.c -- measures the throughput of the decoder and the formatter.
+ *
+ * The benchmark builds three streams of valid 16-bit instructions:
+ *
+ *   opcodes   every one-byte opcode with a few ModR/M and operand patterns
+ *   modrm     every ModR/M byte for a set of opcodes that take one
+ *   prefix    ModR/M instructions preceded by one to three prefixes
+ *
+ * Each stream is repeated to fill a buffer of about 1 MB, and the decoder
+ * and formatter are timed over every instruction in the buffer. The best of
+ * several runs is reported as instructions per second, nanoseconds per
+ * instruction and, on x86 hosts, time-stamp counter cycles per instruction.
+ *
+ * Usage: x86bench [runs]
+ */
+
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 199309L /* for clock_gettime() */
+#endif
+
+#include "x86codec/x86_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define HAVE_RDTSC 1
+#define read_tsc() __rdtsc()
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#define read_tsc() __rdtsc()
+#else
+#define HAVE_RDTSC 0
+#define read_tsc() 0
+#endif
+
+#define STREAM_SIZE (1 << 20)   /* bytes of code in each stream */
+#define DEFAULT_RUNS 5
+
+/* Holds a stream of instructions and the offset of each instruction. */
+typedef struct bench_stream_t
+{
+    const char *name;
+    unsigned char *code;
+    size_t size;
+    size_t *offsets;
+    size_t count;
+} bench_stream_t;
+
+/* Returns a monotonic time stamp in nanoseconds. */
+static double now_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+/* Simple xorshift generator, so that the streams are reproducible. */
+static uint32_t rnd_state = 2463534242u;
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state >> 8;
+}
+
+/* Appends the instruction in _bytes_ to the stream if it is valid and fits.
+ * Returns non-zero if the instruction was appended.
+ */
+static int append_insn(bench_stream_t *s, const unsigned char *bytes, size_t avail)
+{
+    x86_options_t opt;
+    x86_insn_t insn;
+    int count;
+
+    opt.mode = OPR_16BIT;
+    count = x86_decode(bytes, bytes + avail, &insn, &opt);
+    if (count <= 0 || s->size + count > STREAM_SIZE)
+        return 0;
+
+    memcpy(s->code + s->size, bytes, count);
+    s->offsets[s->count++] = s->size;
+    s->size += count;
+    return 1;
+}
+
+/* Fills the stream by cycling through a generator until it is full. */
+static void fill_stream(
+    bench_stream_t *s,
+    const char *name,
+    size_t (*gen)(unsigned char *bytes, size_t i))
+{
+    unsigned char bytes[X86_MAX_INSN_LENGTH + 8];
+    size_t i, n, misses = 0;
+
+    s->name = name;
+    s->code = (unsigned char *)malloc(STREAM_SIZE);
+    s->offsets = (size_t *)malloc(STREAM_SIZE * sizeof(size_t));
+    s->size = 0;
+    s->count = 0;
+    if (s->code == NULL || s->offsets == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; misses < 1000; i++)
+    {
+        memset(bytes, 0, sizeof(bytes));
+        n = gen(bytes, i);
+        if (append_insn(s, bytes, n))
+            misses = 0;
+        else if (s->size + X86_MAX_INSN_LENGTH > STREAM_SIZE)
+            misses++;
+    }
+}
+
+/* Every one-byte opcode, with varying ModR/M and operand bytes. */
+static size_t gen_opcodes(unsigned char *bytes, size_t i)
+{
+    static const unsigned char modrm[4] = { 0xC0, 0x46, 0x87, 0x06 };
+    size_t k;
+
+    bytes[0] = (unsigned char)(i & 0xFF);
+    bytes[1] = modrm[(i >> 8) & 3];
+    for (k = 2; k < 8; k++)
+        bytes[k] = (unsigned char)rnd();
+    return 8;
+}
+
+/* Every ModR/M byte for opcodes that take one. */
+static size_t gen_modrm(unsigned char *bytes, size_t i)
+{
+    static const unsigned char opcodes[] =
+    {
+        0x00, 0x01, 0x02, 0x03, 0x31, 0x39, 0x69, 0x6B, 0x80, 0x81, 0x83,
+        0x84, 0x85, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0xC4, 0xC5,
+        0xC6, 0xC7, 0xD1, 0xD3, 0xF6, 0xF7, 0xFE, 0xFF
+    };
+    size_t k;
+
+    bytes[0] = opcodes[(i >> 8) % sizeof(opcodes)];
+    bytes[1] = (unsigned char)(i & 0xFF);
+    for (k = 2; k < 8; k++)
+        bytes[k] = (unsigned char)rnd();
+    return 8;
+}
+
+/* ModR/M instructions preceded by one to three prefixes. */
+static size_t gen_prefix(unsigned char *bytes, size_t i)
+{
+    static const unsigned char prefixes[] =
+    {
+        0x26, 0x2E, 0x36, 0x3E, 0x64, 0x65, 0x66, 0x67, 0xF0, 0xF2, 0xF3
+    };
+    size_t k, npfx = 1 + i % 3;
+
+    for (k = 0; k < npfx; k++)
+        bytes[k] = prefixes[rnd() % sizeof(prefixes)];
+    gen_modrm(bytes + npfx, rnd());
+    return npfx + 8;
+}
+
+/* Decodes every instruction in the stream once. Returns a checksum. */
+static size_t run_decode(const bench_stream_t *s, const x86_options_t *opt)
+{
+    size_t i, sum = 0;
+    for (i = 0; i < s->count; i++)
+    {
+        x86_insn_t insn;
+        const unsigned char *p = s->code + s->offsets[i];
+        sum += x86_decode(p, s->code + s->size, &insn, opt) + insn.op;
+    }
+    return sum;
+}
+
+/* Computes the length of every instruction in the stream once. */
+static size_t run_length(const bench_stream_t *s, const x86_options_t *opt)
+{
+    size_t i, sum = 0;
+    for (i = 0; i < s->count; i++)
+    {
+        int flow;
+        const unsigned char *p = s->code + s->offsets[i];
+        sum += x86_insn_length(p, s->code + s->size, opt, &flow) + flow;
+    }
+    return sum;
+}
+
+/* Formats every instruction, which must have been decoded into _insns_. */
+static size_t run_format(const x86_insn_t *insns, size_t count)
+{
+    size_t i, sum = 0;
+    char text[256];
+    for (i = 0; i < count; i++)
+    {
+        x86_format(&insns[i], text, X86_FMT_LOWER|X86_FMT_INTEL);
+        sum += (unsigned char)text[0];
+    }
+    return sum;
+}
+
+/* Prints one result line from the best (shortest) run. */
+static void report(const char *stream, const char *test, size_t count,
+                   double best_ns, double best_cycles)
+{
+    double per_insn = best_ns / (double)count;
+    printf("%-8s %-7s %8lu %12.0f %9.2f", stream, test,
+        (unsigned long)count, 1e9 / per_insn, per_insn);
+    if (HAVE_RDTSC)
+        printf(" %12.1f\n", best_cycles / (double)count);
+    else
+        printf(" %12s\n", "n/a");
+}
+
+static void bench_stream(const bench_stream_t *s, int runs, size_t *checksum)
+{
+    x86_options_t opt;
+    x86_insn_t *insns;
+    double best_ns[3], best_cycles[3];
+    size_t i;
+    int run, test;
+
+    opt.mode = OPR_16BIT;
+    insns = (x86_insn_t *)malloc(s->count * sizeof(x86_insn_t));
+    if (insns == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for (i = 0; i < s->count; i++)
+    {
+        x86_decode(s->code + s->offsets[i], s->code + s->size, &insns[i], &opt);
+    }
+
+    for (test = 0; test < 3; test++)
+    {
+        best_ns[test] = 0;
+        best_cycles[test] = 0;
+        for (run = 0; run < runs; run++)
+        {
+            double t0 = now_ns();
+            uint64_t c0 = read_tsc();
+            double t;
+            uint64_t c;
+
+            switch (test)
+            {
+            case 0: *checksum += run_decode(s, &opt); break;
+            case 1: *checksum += run_length(s, &opt); break;
+            case 2: *checksum += run_format(insns, s->count); break;
+            }
+
+            c = read_tsc() - c0;
+            t = now_ns() - t0;
+            if (run == 0 || t < best_ns[test])
+            {
+                best_ns[test] = t;
+                best_cycles[test] = (double)c;
+            }
+        }
+    }
+
+    report(s->name, "decode", s->count, best_ns[0], best_cycles[0]);
+    report(s->name, "length", s->count, best_ns[1], best_cycles[1]);
+    report(s->name, "format", s->count, best_ns[2], best_cycles[2]);
+    free(insns);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_stream_t streams[3];
+    size_t checksum = 0;
+    int runs = DEFAULT_RUNS;
+    int i;
+
+    if (argc > 1)
+    {
+        runs = atoi(argv[1]);
+        if (runs <= 0)
+        {
+            fprintf(stderr, "Usage: %s [runs]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fill_stream(&streams[0], "opcodes", gen_opcodes);
+    fill_stream(&streams[1], "modrm", gen_modrm);
+    fill_stream(&streams[2], "prefix", gen_prefix);
+
+    printf("%-8s %-7s %8s %12s %9s %12s\n",
+        "stream", "test", "insns", "insn/s", "ns/insn", "cycles/insn");
+    for (i = 0; i < 3; i++)
+    {
+        bench_stream(&streams[i], runs, &checksum);
+        free(streams[i].code);
+        free(streams[i].offsets);
+    }
+
+    /* Print the checksum so that the timed work cannot be optimized away. */
+    printf("checksum %lu\n", (unsigned long)checksum);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include "disassembler.h"
 #include "x86codec/x86_codec.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
@@ -32,36 +33,106 @@ typedef struct dasm_jump_table_t
     dasm_farptr_t current;  /* location of the next jump entry to process */
 } dasm_jump_table_t;
 
+/* Byte attributes are stored as bit planes, one plane per attribute: bit
+ * (b % 64) of word (b / 64) in a plane is the attribute of byte b. A byte is
+ * processed (ATTR_PROCESSED) if it is either code or data, so that flag is
+ * derived from the two type planes rather than stored. An instruction spans
+ * at most two words of a plane, which lets the analysis check and mark it
+ * with a few masked word operations instead of a loop over its bytes.
+ */
+#define PLANE_CODE          0
+#define PLANE_DATA          1
+#define PLANE_BOUNDARY      2
+#define PLANE_BLOCKSTART    3
+#define PLANE_VISITED       4   /* not an attribute: the byte is the target
+                                 * of a xref already put on the worklist */
+#define PLANE_XREF          5   /* not an attribute: the byte is the target
+                                 * of a xref in the target index */
+#define PLANE_COUNT         6
+
+#define PLANE_WORD(b)       ((b) / 64)
+#define PLANE_BIT(b)        ((uint64_t)1 << ((b) % 64))
+
 /* Represents an X86 disassembler. */
 typedef struct x86_dasm_t
 {
     const unsigned char *image;
     size_t image_size;
-    byte_attr_t attr[0x1000000]; /* 1MB bytes */
+    uint64_t *planes[PLANE_COUNT]; /* attribute bit planes (see above) */
+    size_t plane_words;            /* number of words in each plane */
     VECTOR(dasm_xref_t) entry_points; /* dasm_code_block_t code_blocks */
     /* however, it is not exactly a block; it is more like an entry point */
     VECTOR(dasm_jump_table_t) jump_tables;
+    VECTOR(dasm_xref_t) worklist; /* xrefs whose target is to be analyzed */
+    size_t insn_count; /* number of instructions decoded by the analysis */
+    size_t conflict_count; /* number of branches into data or mid-insn */
+
+    /* Index of xrefs by target, rebuilt after each analysis. Targets inside
+     * the image have their bit set in PLANE_XREF; the k-th such target
+     * (counting from address 0) has its xrefs stored in entry_points
+     * starting at xref_start[k]. xref_rank[w] is the number of targets
+     * before word w of the plane. Xrefs to targets outside the image sort
+     * last, starting at xref_tail.
+     */
+    uint32_t *xref_rank;
+    uint32_t *xref_start;
+    size_t xref_tail;
 } x86_dasm_t;
 
 byte_attr_t dasm_get_byte_attr(x86_dasm_t *d, uint32_t offset)
 {
-    return d->attr[offset];
+    size_t w = PLANE_WORD(offset);
+    uint64_t bit = PLANE_BIT(offset);
+    byte_attr_t attr = 0;
+
+    if (offset >= d->image_size)
+        return 0;
+    if (d->planes[PLANE_CODE][w] & bit)
+        attr |= TYPE_CODE;
+    if (d->planes[PLANE_DATA][w] & bit)
+        attr |= TYPE_DATA;
+    if (d->planes[PLANE_BOUNDARY][w] & bit)
+        attr |= ATTR_BOUNDARY;
+    if (d->planes[PLANE_BLOCKSTART][w] & bit)
+        attr |= ATTR_BLOCKSTART;
+    return attr;
 }
 
 x86_dasm_t * dasm_create(const unsigned char *image, size_t size)
 {
     x86_dasm_t *d;
+    int i;
     d = (x86_dasm_t *)malloc(sizeof(x86_dasm_t));
     if (d == NULL)
         return NULL;
     d->image = image;
     d->image_size = size;
-
-    /* Initialize all bytes in the image to unknown status. */
-    memset(d->attr, 0, d->image_size);
+    d->insn_count = 0;
+    d->conflict_count = 0;
+    d->xref_rank = NULL;
+    d->xref_start = NULL;
+    d->xref_tail = 0;
+
+    /* Initialize all bytes in the image to unknown status. The planes
+     * are zero-filled by calloc(), which for large blocks maps fresh pages
+     * from the OS; a page is only committed when the analysis first
+     * touches it, so regions that are never reached cost no memory.
+     */
+    d->plane_words = (size + 63) / 64;
+    d->planes[0] = (uint64_t *)calloc(
+        PLANE_COUNT * (d->plane_words > 0 ? d->plane_words : 1),
+        sizeof(uint64_t));
+    if (d->planes[0] == NULL)
+    {
+        free(d);
+        return NULL;
+    }
+    for (i = 1; i < PLANE_COUNT; i++)
+        d->planes[i] = d->planes[i - 1] + d->plane_words;
 
     VECTOR_CREATE(d->entry_points, dasm_xref_t);
     VECTOR_CREATE(d->jump_tables, dasm_jump_table_t);
+    VECTOR_CREATE(d->worklist, dasm_xref_t);
     return d;
 }
 
@@ -71,6 +142,10 @@ void dasm_destroy(x86_dasm_t *d)
     {
         VECTOR_DESTROY(d->entry_points);
         VECTOR_DESTROY(d->jump_tables);
+        VECTOR_DESTROY(d->worklist);
+        free(d->xref_rank);
+        free(d->xref_start);
+        free(d->planes[0]);
         free(d);
     }
 }
@@ -81,9 +156,62 @@ void dasm_destroy(x86_dasm_t *d)
 #define ST_UNEXPECTED_CODE  -3
 #define ST_BAD_INSTRUCTION  -4
 
+/* Returns the bits of word _w_ of a plane that are covered by the byte range
+ * [first, first + count).
+ */
+static uint64_t span_mask(size_t first, size_t count, size_t w)
+{
+    size_t begin = (first > w * 64)? first - w * 64 : 0;
+    size_t end = first + count - w * 64;
+    uint64_t mask = ~(uint64_t)0 << begin;
+    if (end < 64)
+        mask &= ~(~(uint64_t)0 << end);
+    return mask;
+}
+
+/* Sets the bits of a plane for the byte range [first, first + count). */
+static void set_span(uint64_t *plane, size_t first, size_t count)
+{
+    size_t w;
+    for (w = PLANE_WORD(first); w <= PLANE_WORD(first + count - 1); w++)
+        plane[w] |= span_mask(first, count, w);
+}
+
+/* Clears the bits of a plane for the byte range [first, first + count). */
+static void clear_span(uint64_t *plane, size_t first, size_t count)
+{
+    size_t w;
+    for (w = PLANE_WORD(first); w <= PLANE_WORD(first + count - 1); w++)
+        plane[w] &= ~span_mask(first, count, w);
+}
+
+/* Checks that no byte in the range [first, first + count) is processed.
+ * Returns ST_OK if so. Otherwise returns ST_UNEXPECTED_CODE or 
+ * ST_UNEXPECTED_DATA according to the type of the first processed byte.
+ */
+static int check_span(x86_dasm_t *d, size_t first, size_t count)
+{
+    const uint64_t *code = d->planes[PLANE_CODE];
+    const uint64_t *data = d->planes[PLANE_DATA];
+    size_t w;
+    for (w = PLANE_WORD(first); w <= PLANE_WORD(first + count - 1); w++)
+    {
+        uint64_t hit = (code[w] | data[w]) & span_mask(first, count, w);
+        if (hit)
+        {
+            hit &= ~hit + 1; /* lowest processed byte */
+            return (code[w] & hit)? ST_UNEXPECTED_CODE : ST_UNEXPECTED_DATA;
+        }
+    }
+    return ST_OK;
+}
+
 /* Try decode an instruction from the byte range starting at offset _start_.
- * If successful, stores the instruction in _insn_ and returns the number
- * of bytes consumed. Otherwise returns one of the following error codes:
+ * If successful, stores the control flow class of the instruction (enum
+ * x86_flow_class) in _flow_ and returns the number of bytes consumed. Only
+ * the length of the instruction is decoded; the caller must call x86_decode()
+ * if it needs the operands. Otherwise returns one of the following error
+ * codes:
  *
  * ST_ALREADY_ANALYZED 
  *      The byte is already analyzed (as code).
@@ -97,55 +225,54 @@ void dasm_destroy(x86_dasm_t *d)
  *      analyzed as code. However, the byte itself is not previously analyzed
  *      to be the start of an instruction.
  */
-int decode_instruction(x86_dasm_t *d, dasm_farptr_t start, x86_insn_t *insn)
+int decode_instruction(x86_dasm_t *d, dasm_farptr_t start, int *flow)
 {
     size_t b = FARPTR_TO_OFFSET(start);
-    int count, i;
+    int count;
     x86_options_t opt = { OPR_16BIT };
 
+    /* A location outside the image cannot hold an instruction. */
+    if (b >= d->image_size)
+        return ST_BAD_INSTRUCTION;
+
     /* If the byte to analyze is already interpreted as data, return a 
      * conflict status.
      */
-    if ((d->attr[b] & ATTR_TYPE) == TYPE_DATA)
+    if (d->planes[PLANE_DATA][PLANE_WORD(b)] & PLANE_BIT(b))
         return ST_UNEXPECTED_DATA;
 
     /* If this byte to analyze is already interpreted as code, check that
      * it was treated as the first byte of an instruction. Otherwise, return
      * a conflict status.
      */
-    if ((d->attr[b] & ATTR_TYPE) == TYPE_CODE)
+    if (d->planes[PLANE_CODE][PLANE_WORD(b)] & PLANE_BIT(b))
     {
-        if (d->attr[b] & ATTR_BOUNDARY)
+        if (d->planes[PLANE_BOUNDARY][PLANE_WORD(b)] & PLANE_BIT(b))
             return ST_ALREADY_ANALYZED;
         else
             return ST_UNEXPECTED_CODE;
     }
 
-    /* Decode an instruction at this location. */
-    count = x86_decode(d->image + b, d->image + d->image_size, insn, &opt);
+    /* Find the length of the instruction at this location. */
+    count = x86_insn_length(d->image + b, d->image + d->image_size, &opt, flow);
     if (count <= 0)
         return ST_BAD_INSTRUCTION;
 
     /* Check that the entire instruction covers unprocessed area. If any byte
      * in the area is already processed, return an error.
      */
-    for (i = 1; i < count; i++)
+    if (count > 1)
     {
-        if (d->attr[b + i] & ATTR_PROCESSED)
-        {
-            return (d->attr[b + i] & ATTR_TYPE) == TYPE_CODE ?
-                ST_UNEXPECTED_CODE : ST_UNEXPECTED_DATA;
-        }
+        int status = check_span(d, b + 1, count - 1);
+        if (status != ST_OK)
+            return status;
     }
 
     /* Mark the bytes covered by the instruction as code. */
-    for (i = 0; i < count; i++)
-    {
-        d->attr[b + i] &= ~ATTR_TYPE;
-        d->attr[b + i] |= TYPE_CODE;
-        d->attr[b + i] &= ~ATTR_BOUNDARY;
-    }
-    d->attr[b] |= ATTR_BOUNDARY;
+    clear_span(d->planes[PLANE_DATA], b, count);
+    set_span(d->planes[PLANE_CODE], b, count);
+    clear_span(d->planes[PLANE_BOUNDARY], b, count);
+    d->planes[PLANE_BOUNDARY][PLANE_WORD(b)] |= PLANE_BIT(b);
             
     /* Return the number of bytes consumed. */
     return count;
@@ -166,25 +293,43 @@ static dasm_farptr_t increment_farptr(dasm_farptr_t p, uint16_t increment)
     return q;
 }
 
+/* Records a xref and puts it on the worklist so that its target will be
+ * analyzed, unless the target was put on the worklist before. A target
+ * outside the image is always queued so that the failure gets reported.
+ */
+static void add_xref(x86_dasm_t *d, dasm_xref_t xref)
+{
+    uint32_t b = FARPTR_TO_OFFSET(xref.target);
+
+    VECTOR_PUSH(d->entry_points, xref);
+    if (b < d->image_size)
+    {
+        uint64_t *visited = &d->planes[PLANE_VISITED][PLANE_WORD(b)];
+        if (*visited & PLANE_BIT(b))
+            return;
+        *visited |= PLANE_BIT(b);
+    }
+    VECTOR_PUSH(d->worklist, xref);
+}
+
 /* Analyze an instruction decoded from offset _start_ for _count_ bytes.
  * TBD: address wrapping if IP is above 0xFFFF is not handled. It should be.
  */
 int analyze_flow_instruction(x86_dasm_t *d, dasm_farptr_t start, size_t count, x86_insn_t *insn)
 {
-    int op = insn->op;
-
+    switch (x86_insn_info[insn->op].flow)
+    {
     /* If this is an unconditional JMP instruction, push the jump target to
      * the queue and finish this block.
      */
-    if (op == I_JMP || op == I_JMPN)
-    {
+    case X86_FLOW_JUMP:
         if (insn->oprs[0].type == OPR_REL) /* near jump to relative address */
         {
             dasm_xref_t xref;
             xref.source = start;
             xref.target = increment_farptr(start, count + insn->oprs[0].val.rel);
             xref.type = XREF_UNCONDITIONAL_JUMP;
-            VECTOR_PUSH(d->entry_points, xref);
+            add_xref(d, xref);
             return FLOW_FINISH_BLOCK;
         }
         if (insn->oprs[0].type == OPR_PTR) /* far jump to absolute address */
@@ -194,7 +339,7 @@ int analyze_flow_instruction(x86_dasm_t *d, dasm_farptr_t start, size_t count, x
             xref.target.seg = insn->oprs[0].val.ptr.seg;
             xref.target.off = (uint16_t)insn->oprs[0].val.ptr.off;
             xref.type = XREF_UNCONDITIONAL_JUMP;
-            VECTOR_PUSH(d->entry_points, xref);
+            add_xref(d, xref);
             return FLOW_FINISH_BLOCK;
         }
 
@@ -227,29 +372,25 @@ int analyze_flow_instruction(x86_dasm_t *d, dasm_farptr_t start, size_t count, x
             return FLOW_FINISH_BLOCK;
         }
         return FLOW_DYNAMIC_JUMP;
-    }
 
-    /* If this is a RET instruction, finish the current block. */
-    if (op == I_RETN || op == I_RETF)
-    {
+    /* If this is a RET or IRET instruction, finish the current block. */
+    case X86_FLOW_RET:
         return FLOW_FINISH_BLOCK;
-    }
 
     /* If this is a CALL instruction, push the call target to the queue and
-     * finish this block.
+     * continue with the next instruction.
      *
      * Note: We need to know whether the subroutine being called will ever
      * return. For the moment we assume that it will return. 
      */
-    if (op == I_CALL || op == I_CALLF)
-    {
+    case X86_FLOW_CALL:
         if (insn->oprs[0].type == OPR_REL)
         {
             dasm_xref_t xref;
             xref.source = start;
             xref.target = increment_farptr(start, count + insn->oprs[0].val.rel);
             xref.type = XREF_FUNCTION_CALL;
-            VECTOR_PUSH(d->entry_points, xref);
+            add_xref(d, xref);
             return FLOW_CONTINUE;
         }
         if (insn->oprs[0].type == OPR_PTR)
@@ -259,85 +400,108 @@ int analyze_flow_instruction(x86_dasm_t *d, dasm_farptr_t start, size_t count, x
             xref.target.seg = insn->oprs[0].val.ptr.seg;
             xref.target.off = (uint16_t)insn->oprs[0].val.ptr.off;
             xref.type = XREF_FUNCTION_CALL;
-            VECTOR_PUSH(d->entry_points, xref);
+            add_xref(d, xref);
             return FLOW_CONTINUE;
         }
         return FLOW_DYNAMIC_CALL;
-    }
-        
-    /* If this is a Jcc/JCXZ instruction, push the jump target to the queue, 
-     * and follow the flow assuming no jump.
+
+    /* If this is a Jcc/JCXZ/LOOPcc instruction, push the jump target to the
+     * queue, and follow the flow assuming no jump.
      *
      * Note: We assume that "no jump" is a reachable branch. If the code is
      * ill-formed such that the "no jump" branch will never be executed, the
      * analysis may not work correctly.
      */
-    switch (op)
-    {
-    case I_JO:
-    case I_JNO:
-    case I_JB:
-    case I_JNB:
-    case I_JE:
-    case I_JNE:
-    case I_JBE:
-    case I_JNBE:
-    case I_JS:
-    case I_JNS:
-    case I_JP:
-    case I_JNP:
-    case I_JL:
-    case I_JNL:
-    case I_JLE:
-    case I_JNLE:
-    case I_JCXZ:
+    case X86_FLOW_JCC:
         if (insn->oprs[0].type == OPR_REL) /* jump to relative position */
         {
             dasm_xref_t xref;
             xref.source = start;
             xref.target = increment_farptr(start, count + insn->oprs[0].val.rel);
             xref.type = XREF_CONDITIONAL_JUMP;
-            VECTOR_PUSH(d->entry_points, xref);
+            add_xref(d, xref);
             return FLOW_CONTINUE;
         }
         /* A valid Jcc instruction must jump to relative address. If not,
          * the instruction is malformed.
          */
         return FLOW_FAILED;
-    }
 
     /* This is not a flow-control instruction, so continue as usual. */
-    return FLOW_CONTINUE;
+    default:
+        return FLOW_CONTINUE;
+    }
 }
 
-/* Print statistics about the number of bytes analyzed. */
-void dasm_stat(x86_dasm_t *d)
+static unsigned int popcount64(uint64_t x)
 {
-    size_t b;
-    size_t total = d->image_size, code = 0, data = 0, insn = 0;
+#if defined(__GNUC__)
+    return (unsigned int)__builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+void dasm_get_stats(x86_dasm_t *d, dasm_stats_t *stats)
+{
+    const uint64_t *code = d->planes[PLANE_CODE];
+    const uint64_t *data = d->planes[PLANE_DATA];
+    const uint64_t *boundary = d->planes[PLANE_BOUNDARY];
+    size_t w, i;
+
+    memset(stats, 0, sizeof(dasm_stats_t));
+    stats->image_size = d->image_size;
 
-    for (b = 0; b < total; b++)
+    /* Bits beyond the end of the image are never set, so whole words can
+     * be counted.
+     */
+    for (w = 0; w < d->plane_words; w++)
     {
-        if ((d->attr[b] & ATTR_TYPE) == TYPE_CODE)
-        {
-            ++code;
-            if (d->attr[b] & ATTR_BOUNDARY)
-                ++insn;
-        }
-        else if ((d->attr[b] & ATTR_TYPE) == TYPE_DATA)
-            ++data;
+        stats->code_bytes += popcount64(code[w]);
+        stats->data_bytes += popcount64(data[w]);
+        stats->insn_count += popcount64(code[w] & boundary[w]);
     }
+    stats->unknown_bytes = 
+        stats->image_size - stats->code_bytes - stats->data_bytes;
 
-    fprintf(stderr, "Image size: %d bytes\n", total);
-    fprintf(stderr, "Code size : %d bytes\n", code);
-    fprintf(stderr, "Data size : %d bytes\n", data);
-    fprintf(stderr, "# Instructions: %d\n", insn);
+    stats->jump_tables = VECTOR_SIZE(d->jump_tables);
+    for (i = 0; i < VECTOR_SIZE(d->entry_points); i++)
+    {
+        int type = VECTOR_AT(d->entry_points, i).type;
+        if (type >= 0 && type < DASM_XREF_TYPE_COUNT)
+            ++stats->xrefs[type];
+    }
+    stats->conflicts = d->conflict_count;
+}
 
-    fprintf(stderr, "Jump tables: %d\n", VECTOR_SIZE(d->jump_tables));
+/* Print statistics about the number of bytes analyzed. */
+void dasm_stat(x86_dasm_t *d)
+{
+    dasm_stats_t stats;
+    dasm_get_stats(d, &stats);
+
+    fprintf(stderr, "Image size: %lu bytes\n", (unsigned long)stats.image_size);
+    fprintf(stderr, "Code size : %lu bytes\n", (unsigned long)stats.code_bytes);
+    fprintf(stderr, "Data size : %lu bytes\n", (unsigned long)stats.data_bytes);
+    fprintf(stderr, "# Instructions: %lu\n", (unsigned long)stats.insn_count);
+
+    fprintf(stderr, "Jump tables: %lu\n", (unsigned long)stats.jump_tables);
 }
 
 static int verbose = 0;
 
+/* Takes a snapshot of the counters reported in trace spans. */
+static const trace_counters_t *get_trace_counters(x86_dasm_t *d, trace_counters_t *c)
+{
+    c->insns = (uint32_t)d->insn_count;
+    c->xrefs = (uint32_t)VECTOR_SIZE(d->entry_points);
+    c->jump_tables = (uint32_t)VECTOR_SIZE(d->jump_tables);
+    return c;
+}
+
 /* Analyze the code block starting at location _start_ recursively. 
  * Return one of the following status codes:
  *
@@ -351,25 +515,29 @@ void analyze_code_block(x86_dasm_t *d, dasm_xref_t entry)
     /* Maintain a list of pending code entry points to analyze. At the 
      * beginning, there is only one entry point, which is _start_.
      * As we encounter branch instructions (JMP, CALL, or Jcc) on the way, 
-     * we push the target addresses to the queue of entry points, so 
-     * that they can be analyzed later.
+     * we push the target addresses to the worklist, so that they can be
+     * analyzed later. Each target enters the worklist at most once.
      */
-    size_t i = VECTOR_SIZE(d->entry_points);
+    size_t i = VECTOR_SIZE(d->worklist);
+    trace_counters_t counters;
+    trace_span_t span;
+
+    trace_begin(&span, "analyze_code_block", get_trace_counters(d, &counters));
 
     /* Push the entry to the entry list. */
-    VECTOR_PUSH(d->entry_points, entry);
+    add_xref(d, entry);
 
     /* Decode the instruction at p. */
-    for ( ; i < VECTOR_SIZE(d->entry_points); i++)
+    for ( ; i < VECTOR_SIZE(d->worklist); i++)
     {
-        dasm_farptr_t pos = VECTOR_AT(d->entry_points, i).target;
-        dasm_farptr_t from = VECTOR_AT(d->entry_points, i).source;
+        dasm_farptr_t pos = VECTOR_AT(d->worklist, i).target;
+        dasm_farptr_t from = VECTOR_AT(d->worklist, i).source;
 
         if (verbose)
         {
             printf("%04X:%04X  ; -- %s FROM %04X:%04X --\n", 
                 pos.seg, pos.off, 
-                dasm_xref_type_string(VECTOR_AT(d->entry_points, i).type),
+                dasm_xref_type_string(VECTOR_AT(d->worklist, i).type),
                 from.seg, from.off);
         }
 
@@ -380,11 +548,12 @@ void analyze_code_block(x86_dasm_t *d, dasm_xref_t entry)
         while (1)
         {
             x86_insn_t insn;
-            int ret, count;
+            x86_options_t opt = { OPR_16BIT };
+            int ret, count, flow;
             char text[256];
 
             /* Decode an instruction at this location. */
-            ret = decode_instruction(d, pos, &insn);
+            ret = decode_instruction(d, pos, &flow);
             if (ret == ST_ALREADY_ANALYZED)
             {
                 if (verbose)
@@ -393,11 +562,13 @@ void analyze_code_block(x86_dasm_t *d, dasm_xref_t entry)
             }
             if (ret == ST_UNEXPECTED_DATA)
             {
+                ++d->conflict_count;
                 printf("Jump into data!\n");
                 break;
             }
             if (ret == ST_UNEXPECTED_CODE)
             {
+                ++d->conflict_count;
                 fprintf(stderr, "%04X:%04X  %s\n", pos.seg, pos.off, 
                     "Jump into the middle of code!");
                 break;
@@ -408,13 +579,26 @@ void analyze_code_block(x86_dasm_t *d, dasm_xref_t entry)
                 break;
             }
 
+            count = ret;
+            ++d->insn_count;
+
+            /* Only flow-control instructions need to be fully decoded, 
+             * unless we want to display every instruction.
+             */
+            if (flow == X86_FLOW_NONE && !verbose)
+            {
+                pos.off += count;
+                continue;
+            }
+            x86_decode(d->image + FARPTR_TO_OFFSET(pos), 
+                d->image + d->image_size, &insn, &opt);
+
             /* Debug only: display the instruction in assembly. */
             x86_format(&insn, text, X86_FMT_LOWER|X86_FMT_INTEL);
             if (verbose)
                 printf("%04X:%04X  %s\n", pos.seg, pos.off, text);
 
             /* Analyse any flow-control instruction. */
-            count = ret;
             ret = analyze_flow_instruction(d, pos, count, &insn);
             if (ret == FLOW_FINISH_BLOCK)
             {
@@ -428,9 +612,9 @@ void analyze_code_block(x86_dasm_t *d, dasm_xref_t entry)
             }
             if (ret == FLOW_DYNAMIC_CALL)
             {
+                /* Assume that the subroutine returns, as for a direct call. */
                 fprintf(stderr, "%04X:%04X  %-32s ; Dynamic analysis required\n",
                     pos.seg, pos.off, text);
-                break;
             }
             if (ret == FLOW_FAILED)
             {
@@ -449,25 +633,135 @@ void analyze_code_block(x86_dasm_t *d, dasm_xref_t entry)
         if (verbose)
             printf("\n");
     }
+
+    trace_end(&span, get_trace_counters(d, &counters));
 }
 
-static int compare_xrefs_by_target_and_source(const dasm_xref_t *a, const dasm_xref_t *b)
+/* A linear address of a far pointer takes at most 21 bits (0x10FFEF). */
+#define XREF_ADDRESS_BITS   21
+#define XREF_RADIX_BITS     14
+#define XREF_RADIX_SIZE     (1 << XREF_RADIX_BITS)
+#define XREF_RADIX_PASSES   3   /* XREF_RADIX_BITS * 3 >= 2 * XREF_ADDRESS_BITS */
+
+/* Sorts the xrefs by target address and then by source address. Each xref
+ * is packed into a 42-bit key (target, source) and the keys are sorted by
+ * LSD radix sort, which is stable, so xrefs with equal keys keep the order
+ * in which they were recorded. Returns 0 if out of memory.
+ */
+static int sort_xrefs(x86_dasm_t *d)
 {
-    int cmp = (int)FARPTR_TO_OFFSET(a->target) - (int)FARPTR_TO_OFFSET(b->target);
-    if (cmp == 0)
-        cmp = (int)FARPTR_TO_OFFSET(a->source) - (int)FARPTR_TO_OFFSET(b->source);
-    return cmp;
+    size_t n = VECTOR_SIZE(d->entry_points);
+    dasm_xref_t *xrefs = VECTOR_DATA(d->entry_points);
+    uint64_t *keys = (uint64_t *)malloc(2 * n * sizeof(uint64_t) + 1);
+    uint32_t *order = (uint32_t *)malloc(2 * n * sizeof(uint32_t) + 1);
+    size_t *count = (size_t *)malloc(XREF_RADIX_SIZE * sizeof(size_t));
+    dasm_xref_t *sorted = (dasm_xref_t *)malloc(n * sizeof(dasm_xref_t) + 1);
+    uint64_t *src_keys, *dst_keys;
+    uint32_t *src_order, *dst_order;
+    size_t i;
+    int pass, ok = (keys && order && count && sorted);
+
+    if (ok)
+    {
+        src_keys = keys;
+        dst_keys = keys + n;
+        src_order = order;
+        dst_order = order + n;
+        for (i = 0; i < n; i++)
+        {
+            src_keys[i] = 
+                ((uint64_t)FARPTR_TO_OFFSET(xrefs[i].target) << XREF_ADDRESS_BITS) |
+                FARPTR_TO_OFFSET(xrefs[i].source);
+            src_order[i] = (uint32_t)i;
+        }
+
+        for (pass = 0; pass < XREF_RADIX_PASSES; pass++)
+        {
+            int shift = pass * XREF_RADIX_BITS;
+            size_t total = 0;
+            void *t;
+
+            memset(count, 0, XREF_RADIX_SIZE * sizeof(size_t));
+            for (i = 0; i < n; i++)
+                ++count[(src_keys[i] >> shift) & (XREF_RADIX_SIZE - 1)];
+            for (i = 0; i < XREF_RADIX_SIZE; i++)
+            {
+                size_t c = count[i];
+                count[i] = total;
+                total += c;
+            }
+            for (i = 0; i < n; i++)
+            {
+                size_t j = count[(src_keys[i] >> shift) & (XREF_RADIX_SIZE - 1)]++;
+                dst_keys[j] = src_keys[i];
+                dst_order[j] = src_order[i];
+            }
+
+            t = src_keys; src_keys = dst_keys; dst_keys = (uint64_t *)t;
+            t = src_order; src_order = dst_order; dst_order = (uint32_t *)t;
+        }
+
+        for (i = 0; i < n; i++)
+            sorted[i] = xrefs[src_order[i]];
+        if (n > 0)
+            memcpy(xrefs, sorted, n * sizeof(dasm_xref_t));
+    }
+
+    free(keys);
+    free(order);
+    free(count);
+    free(sorted);
+    return ok;
 }
 
-static int compare_xrefs_by_target(const dasm_xref_t *a, const dasm_xref_t *b)
+/* Builds the target index of the sorted xrefs (see x86_dasm_t). Returns 0
+ * if out of memory, in which case every lookup by target finds nothing.
+ */
+static int index_xrefs(x86_dasm_t *d)
 {
-    return (int)FARPTR_TO_OFFSET(a->target) - (int)FARPTR_TO_OFFSET(b->target);
+    size_t n = VECTOR_SIZE(d->entry_points);
+    const dasm_xref_t *xrefs = VECTOR_DATA(d->entry_points);
+    uint64_t *plane = d->planes[PLANE_XREF];
+    size_t i, w, targets = 0;
+    uint32_t total = 0;
+
+    memset(plane, 0, d->plane_words * sizeof(uint64_t));
+    free(d->xref_rank);
+    free(d->xref_start);
+    d->xref_rank = (uint32_t *)malloc(d->plane_words * sizeof(uint32_t) + 1);
+    d->xref_start = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+    if (d->xref_rank == NULL || d->xref_start == NULL)
+        return 0;
+
+    for (i = 0; i < n; i++)
+    {
+        uint32_t b = FARPTR_TO_OFFSET(xrefs[i].target);
+        if (b >= d->image_size)
+            break;
+        if (!(plane[PLANE_WORD(b)] & PLANE_BIT(b)))
+        {
+            plane[PLANE_WORD(b)] |= PLANE_BIT(b);
+            d->xref_start[targets++] = (uint32_t)i;
+        }
+    }
+    d->xref_tail = i;
+
+    for (w = 0; w < d->plane_words; w++)
+    {
+        d->xref_rank[w] = total;
+        total += popcount64(plane[w]);
+    }
+    return 1;
 }
 
 void dasm_analyze(x86_dasm_t *d, dasm_farptr_t start)
 {
     dasm_xref_t entry;
     size_t i = VECTOR_SIZE(d->jump_tables);
+    trace_counters_t counters;
+    trace_span_t span, phase;
+
+    trace_begin(&span, "dasm_analyze", get_trace_counters(d, &counters));
 
     /* Create an entry point using the user-supplied starting offset. */
     entry.target = start;
@@ -487,6 +781,7 @@ void dasm_analyze(x86_dasm_t *d, dasm_farptr_t start)
      * may encounter more jump tables on the way, we do this recursively
      * until there are no more jump tables.
      */
+    trace_begin(&phase, "jump_tables", get_trace_counters(d, &counters));
     for ( ; i < VECTOR_SIZE(d->jump_tables); i++)
     {
         /* Analyze each entry in the jump table by assuming that it contains
@@ -498,20 +793,18 @@ void dasm_analyze(x86_dasm_t *d, dasm_farptr_t start)
         dasm_farptr_t insn_pos = VECTOR_AT(d->jump_tables, i).insn_pos;
         uint32_t table_offset = FARPTR_TO_OFFSET(VECTOR_AT(d->jump_tables, i).start);
         uint32_t entry_offset = table_offset;
-        while (!(d->attr[entry_offset] & ATTR_PROCESSED) && 
-             !(d->attr[entry_offset+1] & ATTR_PROCESSED))
+        while (entry_offset + 1 < d->image_size &&
+             check_span(d, entry_offset, 2) == ST_OK)
         {
             uint16_t target = (uint16_t)d->image[entry_offset] | 
                 ((uint16_t)d->image[entry_offset+1] << 8);
 
             /* Mark this entry as data. */
-            d->attr[entry_offset] &= ~ATTR_TYPE;
-            d->attr[entry_offset] |= TYPE_DATA;
-            d->attr[entry_offset] |= ATTR_BOUNDARY;
-
-            d->attr[entry_offset+1] &= ~ATTR_TYPE;
-            d->attr[entry_offset+1] |= TYPE_DATA;
-            d->attr[entry_offset+1] &= ~ATTR_BOUNDARY;
+            clear_span(d->planes[PLANE_CODE], entry_offset, 2);
+            set_span(d->planes[PLANE_DATA], entry_offset, 2);
+            clear_span(d->planes[PLANE_BOUNDARY], entry_offset, 2);
+            d->planes[PLANE_BOUNDARY][PLANE_WORD(entry_offset)] |= 
+                PLANE_BIT(entry_offset);
 
             entry.target.seg = insn_pos.seg;
             entry.target.off = target;
@@ -530,12 +823,17 @@ void dasm_analyze(x86_dasm_t *d, dasm_farptr_t start)
             entry_offset += 2;
         }
     }
+    trace_end(&phase, get_trace_counters(d, &counters));
 
     /* Sort the XREFs built from the above analyses by target address. 
      * After this is done, the client can easily list the disassembled
      * instructions with xrefs sequentially in physical order.
      */
-    VECTOR_QSORT(d->entry_points, compare_xrefs_by_target_and_source);
+    trace_begin(&phase, "sort_xrefs", get_trace_counters(d, &counters));
+    if (!sort_xrefs(d) || !index_xrefs(d))
+        fprintf(stderr, "Out of memory while indexing xrefs\n");
+    trace_end(&phase, get_trace_counters(d, &counters));
+    trace_end(&span, get_trace_counters(d, &counters));
 
 #if 0
         /* Output address. */
@@ -579,24 +877,29 @@ dasm_enum_xrefs(
         return (xref < first + VECTOR_SIZE(d->entry_points))? xref : NULL;
     }
 
-    /* If prev is NULL, find the first xref that matches the target. */
+    /* If prev is NULL, find the first xref that matches the target. For a
+     * target inside the image, the index gives its position directly.
+     */
     if (prev == NULL) 
     {
-        dasm_xref_t match;
-        match.target.seg = (uint16_t)(target_offset >> 4);
-        match.target.off = (uint16_t)(target_offset & 0xf);
-        
-        xref = bsearch(&match, first, VECTOR_SIZE(d->entry_points), sizeof(match),
-            compare_xrefs_by_target);
-        if (xref == NULL)
+        uint64_t word, bit = PLANE_BIT(target_offset);
+
+        if (target_offset >= d->image_size)
+        {
+            size_t i;
+            for (i = d->xref_tail; i < VECTOR_SIZE(d->entry_points); i++)
+            {
+                if (FARPTR_TO_OFFSET(first[i].target) == target_offset)
+                    return first + i;
+            }
             return NULL;
+        }
 
-        /* If there are multiple matches, bsearch() may return any one of
-         * them. So we need to move the pointer to the first one.
-         */
-        while (xref > first && FARPTR_TO_OFFSET(xref[-1].target) == target_offset)
-            --xref;
-        return xref;
+        word = d->planes[PLANE_XREF][PLANE_WORD(target_offset)];
+        if (!(word & bit) || d->xref_start == NULL)
+            return NULL;
+        return first + d->xref_start[
+            d->xref_rank[PLANE_WORD(target_offset)] + popcount64(word & (bit - 1))];
     }
 
     /* Return the next xref if it matches target_offset. */
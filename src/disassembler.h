@@ -17,7 +17,9 @@ typedef x86_farptr16_t dasm_farptr_t;
 /* An opaque structure that represents a disassembler object. */
 typedef struct x86_dasm_t x86_dasm_t;
 
-/* Creates a disassembler for the given executable image. */
+/* Creates a disassembler for the given executable image. Returns NULL if
+ * out of memory.
+ */
 x86_dasm_t* dasm_create(const unsigned char *image, size_t size);
 
 /* Destroys a disassembler previously created with dasm_create(). */
@@ -31,6 +33,30 @@ void dasm_analyze(x86_dasm_t *d, dasm_farptr_t start);
 /* Prints diagnostics information about a disassembler on standard error. */
 void dasm_stat(x86_dasm_t *d);
 
+/* Number of xref types counted separately in dasm_stats_t. */
+#define DASM_XREF_TYPE_COUNT 5
+
+/* Summary of the results of the analysis. */
+typedef struct dasm_stats_t
+{
+    size_t image_size;      /* number of bytes in the image */
+    size_t code_bytes;      /* number of bytes analyzed as code */
+    size_t data_bytes;      /* number of bytes analyzed as data */
+    size_t unknown_bytes;   /* number of bytes not reached by the analysis */
+    size_t insn_count;      /* number of instructions in the code bytes */
+    size_t jump_tables;     /* number of jump tables found */
+    size_t xrefs[DASM_XREF_TYPE_COUNT]; /* number of xrefs of each type */
+    size_t conflicts;       /* number of branches into data or into the
+                             * middle of an instruction
+                             */
+} dasm_stats_t;
+
+/* Fills _stats_ with a summary of the analysis. The byte counts are taken
+ * from the attribute bit planes a word at a time, so this is cheap enough
+ * to call for every image in a batch.
+ */
+void dasm_get_stats(x86_dasm_t *d, dasm_stats_t *stats);
+
 
 typedef unsigned char byte_attr_t;
 
@@ -50,7 +76,9 @@ typedef unsigned char byte_attr_t;
                              * an instruction that starts a basic block.
                              */
 
-/* Returns the attribute of a given byte. */
+/* Returns the attribute of a given byte, or 0 if _offset_ is beyond the end
+ * of the image.
+ */
 byte_attr_t dasm_get_byte_attr(x86_dasm_t *d, uint32_t offset);
 
 /* Enumerated values of xref types. */
@@ -0,0 +1,254 @@
+/* export.c -- machine-readable export of analysis results */
+
+#include "export.h"
+#include "x86codec/x86_codec.h"
+#include <string.h>
+
+static void put_u16(out_sink_t *s, uint16_t x)
+{
+    unsigned char *p = (unsigned char *)out_reserve(s, 2);
+    p[0] = (unsigned char)x;
+    p[1] = (unsigned char)(x >> 8);
+    out_commit(s, 2);
+}
+
+static void put_u32(out_sink_t *s, uint32_t x)
+{
+    unsigned char *p = (unsigned char *)out_reserve(s, 4);
+    p[0] = (unsigned char)x;
+    p[1] = (unsigned char)(x >> 8);
+    p[2] = (unsigned char)(x >> 16);
+    p[3] = (unsigned char)(x >> 24);
+    out_commit(s, 4);
+}
+
+static void put_section(out_sink_t *s, const char tag[4], uint32_t payload_size)
+{
+    out_write(s, tag, 4);
+    put_u32(s, payload_size);
+}
+
+/* Writes "name":value, preceded by a comma unless it is the first field. */
+static void json_number(out_sink_t *s, const char *name, uint32_t value)
+{
+    out_puts(s, ",\"");
+    out_puts(s, name);
+    out_puts(s, "\":");
+    out_dec(s, value);
+}
+
+static void json_string(out_sink_t *s, const char *name, const char *value)
+{
+    out_puts(s, ",\"");
+    out_puts(s, name);
+    out_puts(s, "\":\"");
+    out_puts(s, value);
+    out_putc(s, '"');
+}
+
+static void json_farptr(out_sink_t *s, const char *name, dasm_farptr_t p)
+{
+    out_puts(s, ",\"");
+    out_puts(s, name);
+    out_puts(s, "\":[");
+    out_dec(s, p.seg);
+    out_putc(s, ',');
+    out_dec(s, p.off);
+    out_putc(s, ']');
+}
+
+static void json_range(out_sink_t *s, size_t begin, size_t end, byte_attr_t attr)
+{
+    static const char *kinds[4] = { "unknown", "pending", "code", "data" };
+    out_puts(s, "{\"type\":\"range\"");
+    json_number(s, "begin", (uint32_t)begin);
+    json_number(s, "end", (uint32_t)end);
+    json_string(s, "kind", kinds[attr & ATTR_TYPE]);
+    out_puts(s, "}\n");
+}
+
+/* Writes the INSN record and the insn line of the instruction at offset i.
+ * Either sink may be NULL.
+ */
+static void export_insn(
+    const unsigned char *image,
+    size_t size,
+    size_t i,
+    out_sink_t *bin,
+    out_sink_t *json)
+{
+    x86_options_t opts = { OPR_16BIT };
+    x86_insn_t insn;
+    int count, flow;
+
+    /* Keep one record per instruction boundary even if the bytes do not
+     * decode.
+     */
+    count = x86_decode(image + i, image + size, &insn, &opts);
+    if (count <= 0)
+    {
+        count = 0;
+        insn.op = I_NONE;
+    }
+    flow = x86_insn_info[insn.op].flow;
+
+    if (bin)
+    {
+        put_u32(bin, (uint32_t)i);
+        put_u32(bin, (uint32_t)count);
+        out_putc(bin, (char)flow);
+        out_putc(bin, 0);
+        put_u16(bin, (uint16_t)insn.op);
+    }
+    if (json)
+    {
+        char name[16];
+        size_t k, n;
+        const char *upper = x86_mnemonic_name(insn.op, &n);
+        for (k = 0; k < n && k < sizeof(name) - 1; k++)
+            name[k] = (char)(upper[k] | 0x20);
+        name[k] = 0;
+
+        out_puts(json, "{\"type\":\"insn\"");
+        json_number(json, "addr", (uint32_t)i);
+        json_number(json, "len", (uint32_t)count);
+        json_number(json, "flow", (uint32_t)flow);
+        json_string(json, "op", name);
+        out_puts(json, "}\n");
+    }
+}
+
+/* Copies the contents of memory sink _buf_ to _s_, as the payload of a
+ * section named _tag_ unless _tag_ is NULL. Returns 0 if _buf_ ran out of
+ * memory.
+ */
+static int append_buffer(out_sink_t *s, const char *tag, const out_sink_t *buf)
+{
+    size_t n;
+    const char *data = out_data(buf, &n);
+    if (data == NULL)
+        return 0;
+    if (tag)
+        put_section(s, tag, (uint32_t)n);
+    out_write(s, data, n);
+    return 1;
+}
+
+int dasm_export(
+    x86_dasm_t *d,
+    const unsigned char *image,
+    size_t size,
+    out_sink_t *bin,
+    out_sink_t *json)
+{
+    const dasm_xref_t *xref;
+    out_sink_t *bin_insns = NULL, *bin_xrefs = NULL, *json_insns = NULL;
+    size_t i, begin;
+    byte_attr_t begin_attr;
+    int ok = 1;
+
+    /* The INSN and XREF sections are preceded by their sizes, and the insn
+     * lines follow all range lines, so these are buffered in memory until
+     * the pass over the image is done.
+     */
+    if (bin)
+    {
+        bin_insns = out_open_memory();
+        bin_xrefs = out_open_memory();
+        if (bin_insns == NULL || bin_xrefs == NULL)
+            ok = 0;
+    }
+    if (json)
+    {
+        json_insns = out_open_memory();
+        if (json_insns == NULL)
+            ok = 0;
+    }
+    if (!ok)
+    {
+        out_close(bin_insns);
+        out_close(bin_xrefs);
+        out_close(json_insns);
+        return 0;
+    }
+
+    /* Headers. */
+    if (bin)
+    {
+        out_write(bin, "DASM", 4);
+        put_u16(bin, EXPORT_VERSION);
+        put_u16(bin, 0);
+        put_u32(bin, (uint32_t)size);
+        put_section(bin, "ATTR", (uint32_t)size);
+    }
+    if (json)
+    {
+        out_puts(json, "{\"type\":\"header\"");
+        json_number(json, "version", EXPORT_VERSION);
+        json_number(json, "image_size", (uint32_t)size);
+        out_puts(json, "}\n");
+    }
+
+    /* Attributes and instructions, in one pass over the image. Runs of
+     * bytes of the same type become one range record, and each instruction
+     * boundary is decoded into the instruction buffers.
+     */
+    begin = 0;
+    begin_attr = (size > 0)? dasm_get_byte_attr(d, 0) : 0;
+    for (i = 0; i < size; i++)
+    {
+        byte_attr_t attr = dasm_get_byte_attr(d, (uint32_t)i);
+        if (bin)
+            out_putc(bin, (char)attr);
+        if ((attr & ATTR_TYPE) == TYPE_CODE && (attr & ATTR_BOUNDARY))
+            export_insn(image, size, i, bin_insns, json_insns);
+        if (json && ((attr ^ begin_attr) & ATTR_TYPE))
+        {
+            json_range(json, begin, i, begin_attr);
+            begin = i;
+            begin_attr = attr;
+        }
+    }
+    if (json && size > 0)
+        json_range(json, begin, size, begin_attr);
+
+    if (bin && !append_buffer(bin, "INSN", bin_insns))
+        ok = 0;
+    if (json && !append_buffer(json, NULL, json_insns))
+        ok = 0;
+
+    /* Xrefs, in one enumeration. */
+    xref = NULL;
+    while ((xref = dasm_enum_xrefs(d, (uint32_t)-1, xref)) != NULL)
+    {
+        if (bin)
+        {
+            put_u16(bin_xrefs, xref->target.off);
+            put_u16(bin_xrefs, xref->target.seg);
+            put_u16(bin_xrefs, xref->source.off);
+            put_u16(bin_xrefs, xref->source.seg);
+            out_putc(bin_xrefs, (char)xref->type);
+            out_write(bin_xrefs, "\0\0\0", 3);
+        }
+        if (json)
+        {
+            out_puts(json, "{\"type\":\"xref\"");
+            json_farptr(json, "target", xref->target);
+            json_farptr(json, "source", xref->source);
+            json_string(json, "kind", dasm_xref_type_string(xref->type));
+            out_puts(json, "}\n");
+        }
+    }
+
+    if (bin)
+    {
+        if (!append_buffer(bin, "XREF", bin_xrefs))
+            ok = 0;
+        put_section(bin, "END ", 0);
+    }
+
+    out_close(bin_insns);
+    out_close(bin_xrefs);
+    out_close(json_insns);
+    return ok;
+}
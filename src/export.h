@@ -0,0 +1,68 @@
+/* export.h -- machine-readable export of analysis results */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stddef.h>
+#include "disassembler.h"
+#include "output.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Version of the binary and JSON-lines export formats. */
+#define EXPORT_VERSION 2
+
+/*
+ * Binary format. All integers are little-endian.
+ *
+ *   header:   char magic[4] = "DASM"; uint16 version; uint16 reserved = 0;
+ *             uint32 image_size
+ *   sections: char tag[4]; uint32 payload_size; payload[payload_size]
+ *
+ * Sections appear in the following order. Readers should skip sections
+ * with unknown tags.
+ *
+ *   "ATTR"    one byte_attr_t per byte of the image
+ *   "INSN"    12 bytes per instruction boundary, in address order:
+ *             uint32 address; uint32 length; uint8 flow (enum
+ *             x86_flow_class); uint8 reserved; uint16 mnemonic (enum
+ *             x86_insn_mnemonic). The length is not limited to
+ *             X86_MAX_INSN_LENGTH, since a run of redundant prefixes
+ *             decodes as one instruction; version 1 stored it as uint8.
+ *   "XREF"    12 bytes per xref, in the order of dasm_enum_xrefs():
+ *             uint16 target_off, target_seg, source_off, source_seg;
+ *             uint8 type (dasm_xref_type); uint8 reserved[3]
+ *   "END "    empty; marks the end of the file
+ *
+ * JSON-lines format. One object per line, in the following order:
+ *
+ *   {"type":"header","version":2,"image_size":N}
+ *   {"type":"range","begin":B,"end":E,"kind":"code"}  (end is exclusive;
+ *             kind is one of "unknown", "pending", "code" and "data")
+ *   {"type":"insn","addr":A,"len":L,"flow":F,"op":"mov"}
+ *   {"type":"xref","target":[SEG,OFF],"source":[SEG,OFF],"kind":"XREF_..."}
+ */
+
+/* Writes the attributes, instruction boundaries and xrefs of an analyzed
+ * image in binary format to _bin_ and in JSON-lines format to _json_. Either
+ * sink may be NULL. Both are written in a single pass over the image and a
+ * single enumeration of the xrefs; the instruction records and the binary
+ * xref records are buffered in memory until they can be written in the
+ * order above. Returns 0 if it runs out of memory for these buffers, in
+ * which case the output is incomplete, or 1 otherwise. Write errors are
+ * reported by the sinks.
+ */
+int dasm_export(
+    x86_dasm_t *d,                  /* analyzed disassembler object */
+    const unsigned char *image,     /* executable image */
+    size_t size,                    /* size of the image in bytes */
+    out_sink_t *bin,                /* sink for the binary format, or NULL */
+    out_sink_t *json);              /* sink for JSON lines, or NULL */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXPORT_H */
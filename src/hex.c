@@ -0,0 +1,176 @@
+/* hex.c -- hexadecimal encoding of byte strings */
+
+#include "hex.h"
+
+/* Select the widest kernel that the target instruction set allows. SSSE3
+ * is only used to insert the spaces between the digit pairs; it is implied
+ * by AVX, and MSVC does not define a macro for it otherwise.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEX_USE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#define HEX_USE_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define HEX_USE_AVX2
+#include <immintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Encodes the bytes one at a time. */
+static void encode_scalar(char *dst, const unsigned char *src, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        dst[0] = hex_digits[src[i] >> 4];
+        dst[1] = hex_digits[src[i] & 0xf];
+        dst[2] = ' ';
+        dst += 3;
+    }
+}
+
+#ifdef HEX_USE_SSE2
+
+/* Converts each nibble (0-15) in a vector to its hexadecimal digit. */
+static __m128i nibble_to_hex(__m128i n)
+{
+    __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+    n = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    return _mm_add_epi8(n, _mm_and_si128(letter, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+#ifdef HEX_USE_SSSE3
+/* Spreads the digit pairs over the "xx " triples of the output. Output
+ * vector k takes characters 16*k to 16*k+15; -128 yields a zero byte, which
+ * is then filled with a space.
+ */
+#define SHUFFLE_0A _mm_setr_epi8(0, 1, -128, 2, 3, -128, 4, 5, -128, 6, 7, -128, 8, 9, -128, 10)
+#define SHUFFLE_1A _mm_setr_epi8(11, -128, 12, 13, -128, 14, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128)
+#define SHUFFLE_1B _mm_setr_epi8(-128, -128, -128, -128, -128, -128, -128, -128, 0, 1, -128, 2, 3, -128, 4, 5)
+#define SHUFFLE_2B _mm_setr_epi8(-128, 6, 7, -128, 8, 9, -128, 10, 11, -128, 12, 13, -128, 14, 15, -128)
+#define SPACES_0   _mm_setr_epi8(0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0)
+#define SPACES_1   _mm_setr_epi8(0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0)
+#define SPACES_2   _mm_setr_epi8(32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32)
+#endif
+
+/* Stores the digit pairs of 16 bytes as 48 characters. _a_ holds the digit
+ * pairs of the first 8 bytes, and _b_ those of the last 8 bytes.
+ */
+static void store_spaced(char *dst, __m128i a, __m128i b)
+{
+#ifdef HEX_USE_SSSE3
+    __m128i v0 = _mm_or_si128(_mm_shuffle_epi8(a, SHUFFLE_0A), SPACES_0);
+    __m128i v1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, SHUFFLE_1A),
+                                           _mm_shuffle_epi8(b, SHUFFLE_1B)), SPACES_1);
+    __m128i v2 = _mm_or_si128(_mm_shuffle_epi8(b, SHUFFLE_2B), SPACES_2);
+    _mm_storeu_si128((__m128i *)dst, v0);
+    _mm_storeu_si128((__m128i *)(dst + 16), v1);
+    _mm_storeu_si128((__m128i *)(dst + 32), v2);
+#else
+    union { __m128i v[2]; char c[32]; } pairs;
+    int i;
+    pairs.v[0] = a;
+    pairs.v[1] = b;
+    for (i = 0; i < 16; i++)
+    {
+        dst[3*i] = pairs.c[2*i];
+        dst[3*i+1] = pairs.c[2*i+1];
+        dst[3*i+2] = ' ';
+    }
+#endif
+}
+
+/* Stores the digit pairs of 8 bytes, held in _a_, as 24 characters. */
+static void store_spaced8(char *dst, __m128i a)
+{
+#ifdef HEX_USE_SSSE3
+    __m128i v0 = _mm_or_si128(_mm_shuffle_epi8(a, SHUFFLE_0A), SPACES_0);
+    __m128i v1 = _mm_or_si128(_mm_shuffle_epi8(a, SHUFFLE_1A), SPACES_1);
+    _mm_storeu_si128((__m128i *)dst, v0);
+    _mm_storel_epi64((__m128i *)(dst + 16), v1);
+#else
+    union { __m128i v; char c[16]; } pairs;
+    int i;
+    pairs.v = a;
+    for (i = 0; i < 8; i++)
+    {
+        dst[3*i] = pairs.c[2*i];
+        dst[3*i+1] = pairs.c[2*i+1];
+        dst[3*i+2] = ' ';
+    }
+#endif
+}
+
+#endif /* HEX_USE_SSE2 */
+
+void hex_encode(char *dst, const unsigned char *src, size_t n)
+{
+#ifdef HEX_USE_AVX2
+    const __m256i mask4 = _mm256_set1_epi8(0x0f);
+    for (; n >= 32; n -= 32, src += 32, dst += 96)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask4);
+        __m256i lo = _mm256_and_si256(v, mask4);
+        __m256i hi_letter = _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(9));
+        __m256i lo_letter = _mm256_cmpgt_epi8(lo, _mm256_set1_epi8(9));
+        __m256i a, b;
+
+        hi = _mm256_add_epi8(_mm256_add_epi8(hi, _mm256_set1_epi8('0')),
+                             _mm256_and_si256(hi_letter, _mm256_set1_epi8('a' - '0' - 10)));
+        lo = _mm256_add_epi8(_mm256_add_epi8(lo, _mm256_set1_epi8('0')),
+                             _mm256_and_si256(lo_letter, _mm256_set1_epi8('a' - '0' - 10)));
+
+        /* Unpacking works within each 128-bit lane, so _a_ holds the pairs
+         * of bytes 0-7 and 16-23, and _b_ those of bytes 8-15 and 24-31.
+         */
+        a = _mm256_unpacklo_epi8(hi, lo);
+        b = _mm256_unpackhi_epi8(hi, lo);
+        store_spaced(dst, _mm256_castsi256_si128(a), _mm256_castsi256_si128(b));
+        store_spaced(dst + 48, _mm256_extracti128_si256(a, 1), _mm256_extracti128_si256(b, 1));
+    }
+#endif
+
+#ifdef HEX_USE_SSE2
+    {
+        const __m128i mask4 = _mm_set1_epi8(0x0f);
+        for (; n >= 16; n -= 16, src += 16, dst += 48)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)src);
+            __m128i hi = nibble_to_hex(_mm_and_si128(_mm_srli_epi16(v, 4), mask4));
+            __m128i lo = nibble_to_hex(_mm_and_si128(v, mask4));
+            store_spaced(dst, _mm_unpacklo_epi8(hi, lo), _mm_unpackhi_epi8(hi, lo));
+        }
+        if (n >= 8)
+        {
+            __m128i v = _mm_loadl_epi64((const __m128i *)src);
+            __m128i hi = nibble_to_hex(_mm_and_si128(_mm_srli_epi16(v, 4), mask4));
+            __m128i lo = nibble_to_hex(_mm_and_si128(v, mask4));
+            store_spaced8(dst, _mm_unpacklo_epi8(hi, lo));
+            n -= 8;
+            src += 8;
+            dst += 24;
+        }
+    }
+#endif
+
+    encode_scalar(dst, src, n);
+}
+
+const char *hex_encode_kernel(void)
+{
+#if defined(HEX_USE_AVX2)
+    return "avx2";
+#elif defined(HEX_USE_SSSE3)
+    return "ssse3";
+#elif defined(HEX_USE_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,34 @@
+/* hex.h -- hexadecimal encoding of byte strings */
+
+#ifndef HEX_H
+#define HEX_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of characters written by hex_encode() for n bytes. */
+#define HEX_ENCODED_SIZE(n) ((n) * 3)
+
+/* Encodes n bytes as lower-case hexadecimal digit pairs, each followed by a
+ * space, e.g. "8b 46 fe ". Exactly HEX_ENCODED_SIZE(n) characters are
+ * written to _dst_; no null terminator is appended.
+ *
+ * The bulk of the input is encoded 16 or 32 bytes at a time with SSE2 or
+ * AVX2 when the compiler targets these instruction sets, e.g. with /arch:AVX2
+ * or -mavx2. Otherwise, or for the remaining bytes, a scalar loop is used.
+ */
+void hex_encode(char *dst, const unsigned char *src, size_t n);
+
+/* Returns the name of the kernel selected at compile time, i.e. "avx2",
+ * "ssse3", "sse2" or "scalar".
+ */
+const char *hex_encode_kernel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEX_H */
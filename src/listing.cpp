@@ -0,0 +1,730 @@
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "x86codec/x86_codec.h"
+#include "listing.h"
+#include "hex.h"
+
+// Number of image bytes to put in each chunk, before rounding up to the
+// next instruction boundary. Several chunks per thread keep the workers
+// busy when code and data are unevenly distributed.
+#define LISTING_CHUNK_SIZE 16384
+
+// Number of chunks per worker thread that may be formatted ahead of the
+// writer. This bounds the memory held by formatted but unwritten text.
+#define LISTING_CHUNKS_AHEAD 4
+
+// Listing of a range of the image, produced by one worker.
+struct listing_chunk_t
+{
+    size_t begin;           // offset of the first byte listed
+    size_t end;             // the walk stops at the first offset >= end
+    size_t exit;            // offset where the walk actually stopped
+    bool leading_break;     // starts with data, needs a blank line if the
+                            // previous chunk ends with an instruction
+    bool trailing_insn;     // ends with an instruction
+    bool failed;            // stopped at undecodable code
+    out_sink_t *text;       // formatted output
+};
+
+// Columns for decoding the instructions of a chunk with x86_decode_batch(),
+// reused from one chunk to the next.
+struct chunk_decoder_t
+{
+    std::vector<size_t> offsets;
+    std::vector<uint8_t> length;
+    std::vector<uint16_t> mnemonic;
+    std::vector<x86_insn_prefix_t> prefix;
+    std::vector<uint8_t> opr_kind;
+    std::vector<uint64_t> opr_data;
+    x86_insn_batch_t batch;
+};
+
+static bool is_instruction_start(x86_dasm_t *d, size_t i)
+{
+    byte_attr_t attr = dasm_get_byte_attr(d, (uint32_t)i);
+    return (attr & ATTR_TYPE) == TYPE_CODE && (attr & ATTR_BOUNDARY);
+}
+
+// Dense map of the addresses that have a label. A bit is set for each
+// instruction that has xrefs, which is where the listing prints a
+// "loc_XXXX:" label, so a lookup takes one load.
+struct label_cache_t
+{
+    std::vector<uint64_t> bits;     // one bit per byte of the image
+};
+
+static void build_label_cache(x86_dasm_t *d, size_t size, label_cache_t *cache)
+{
+    size_t words = (size + 63) / 64;
+    cache->bits.assign(words, 0);
+
+    const dasm_xref_t *xref = NULL;
+    while ((xref = dasm_enum_xrefs(d, (uint32_t)-1, xref)) != NULL)
+    {
+        size_t target = (size_t)xref->target.seg * 16 + xref->target.off;
+        if (target < size && is_instruction_start(d, target))
+            cache->bits[target / 64] |= (uint64_t)1 << (target % 64);
+    }
+}
+
+// Returns true if there is a label at _address_.
+static bool has_label(const label_cache_t *cache, uint32_t address)
+{
+    size_t w = address / 64;
+    if (w >= cache->bits.size())
+        return false;
+    return ((cache->bits[w] >> (address % 64)) & 1) != 0;
+}
+
+// Writes the name of the label at _address_, "loc_XXXX", and returns its
+// length.
+static size_t format_label_name(uint32_t address, char *p)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    size_t n = 1;
+    for (uint32_t v = address >> 4; v != 0; v >>= 4)
+        n++;
+
+    memcpy(p, "loc_", 4);
+    for (size_t k = 4 + n; k > 4; address >>= 4)
+        p[--k] = digits[address & 0xf];
+    return 4 + n;
+}
+
+// Symbolizer callback that resolves an address through a label cache.
+static size_t lookup_label(void *arg, uint32_t address, char *buffer)
+{
+    const label_cache_t *cache = (const label_cache_t *)arg;
+    if (!has_label(cache, address))
+        return 0;
+    return format_label_name(address, buffer);
+}
+
+// Appends the line that lists the xrefs of one type to the instruction at
+// offset i, starting with _xref_. The first line of an instruction carries
+// its label. Returns the first xref of the next type, or NULL.
+static const dasm_xref_t *format_xref_line(
+    x86_dasm_t *d,
+    size_t i,
+    const dasm_xref_t *xref,
+    bool first,
+    out_sink_t *out)
+{
+    if (first)
+    {
+        // Label "loc_XXXX:", padded to 10 characters.
+        char label[X86_LABEL_BUFSIZE];
+        size_t length = format_label_name((uint32_t)i, label);
+        label[length++] = ':';
+        label[length] = 0;
+        out_pad(out, label, 10);
+    }
+    else
+    {
+        out_pad(out, "", 10);
+    }
+
+    dasm_xref_type type = xref->type;
+    out_puts(out, " ; ");
+    out_puts(out, dasm_xref_type_string(type));
+    out_putc(out, ':');
+    while (xref && xref->type == type)
+    {
+        out_putc(out, ' ');
+        out_hex(out, xref->source.seg, 4);
+        out_putc(out, ':');
+        out_hex(out, xref->source.off, 4);
+        xref = dasm_enum_xrefs(d, (uint32_t)i, xref);
+    }
+    out_putc(out, '\n');
+    return xref;
+}
+
+// Appends the xref comments of the instruction at offset i, if any.
+static void format_xrefs(x86_dasm_t *d, size_t i, out_sink_t *out)
+{
+    const dasm_xref_t *xref = dasm_enum_xrefs(d, (uint32_t)i, NULL);
+    if (!xref)
+        return;
+
+    out_putc(out, '\n');
+    for (bool first = true; xref; first = false)
+        xref = format_xref_line(d, i, xref, first, out);
+}
+
+// Appends the line of the instruction at offset i, which is _count_ bytes
+// long and decodes to _insn_. _labels_ is only used with LISTING_LABELS.
+static void format_insn_line(
+    const unsigned char *image,
+    size_t i,
+    int count,
+    const x86_insn_t *insn,
+    unsigned int flags,
+    const label_cache_t *labels,
+    out_sink_t *out)
+{
+    out_write(out, "0000:", 5);
+    out_hex(out, (uint32_t)i, 4);
+    out_write(out, "  ", 2);
+
+    // Raw bytes column, padded to 8 bytes.
+    if (flags & LISTING_BYTES)
+    {
+        int n = (count < 8)? count : 8;
+        char *column = out_reserve(out, HEX_ENCODED_SIZE(8));
+        hex_encode(column, image + i, n);
+        memset(column + HEX_ENCODED_SIZE(n), ' ', HEX_ENCODED_SIZE(8 - n));
+        out_commit(out, HEX_ENCODED_SIZE(8));
+    }
+
+    // Format the instruction in place.
+    char *text = out_reserve(out, X86_FORMAT_BUFSIZE);
+    size_t n;
+    if (flags & LISTING_LABELS)
+    {
+        x86_symbolizer_t sym;
+        sym.label = lookup_label;
+        sym.arg = (void *)labels;
+
+        // The listing does not record segments, so take the instruction
+        // to be in the 64K-aligned segment that contains it.
+        uint32_t base = (uint32_t)i & ~(uint32_t)0xFFFF;
+        n = x86_format_symbolic(insn, base, (uint16_t)i, count, &sym, text,
+                                X86_FORMAT_BUFSIZE, X86_FMT_LOWER|X86_FMT_INTEL);
+    }
+    else
+    {
+        n = x86_format_insn(insn, text, X86_FORMAT_BUFSIZE,
+                            X86_FMT_LOWER|X86_FMT_INTEL);
+    }
+    out_commit(out, (n < X86_FORMAT_BUFSIZE)? n : X86_FORMAT_BUFSIZE - 1);
+    out_putc(out, '\n');
+}
+
+// Decodes every instruction that starts in [begin, end) in one batch.
+// Returns false if out of memory.
+static bool decode_chunk(
+    x86_dasm_t *d,
+    const unsigned char *image,
+    size_t size,
+    size_t begin,
+    size_t end,
+    chunk_decoder_t *dec)
+{
+    x86_options_t opts = { OPR_16BIT };
+    size_t n;
+
+    // This runs on worker threads, so an exception must not escape.
+    try
+    {
+        dec->offsets.clear();
+        for (size_t i = begin; i < end && i < size; i++)
+        {
+            if (is_instruction_start(d, i))
+                dec->offsets.push_back(i);
+        }
+
+        // Reserve one extra entry so that &v[0] is valid even if n is zero.
+        n = dec->offsets.size();
+        dec->length.resize(n + 1);
+        dec->mnemonic.resize(n + 1);
+        dec->prefix.resize(n + 1);
+        dec->opr_kind.resize((n + 1) * MAX_OPERANDS);
+        dec->opr_data.resize((n + 1) * MAX_OPERANDS);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return false;
+    }
+    dec->batch.length = &dec->length[0];
+    dec->batch.mnemonic = &dec->mnemonic[0];
+    dec->batch.prefix = &dec->prefix[0];
+    dec->batch.opr_kind = &dec->opr_kind[0];
+    dec->batch.opr_data = &dec->opr_data[0];
+    if (n > 0)
+        x86_decode_batch(image, image + size, &dec->offsets[0], n, &dec->batch, &opts);
+    return true;
+}
+
+// Lists the bytes from chunk->begin until the walk reaches chunk->end.
+// The walk steps over instructions and visits data bytes one by one, the
+// same way as a serial listing of the whole image does.
+static void format_chunk(
+    x86_dasm_t *d,
+    const unsigned char *image,
+    size_t size,
+    unsigned int flags,
+    const label_cache_t *labels,
+    chunk_decoder_t *dec,
+    listing_chunk_t *chunk)
+{
+    x86_options_t opts = { OPR_16BIT };
+    x86_insn_t insn;
+    size_t k = 0;
+
+    // Tri-state: -1 until the first byte is seen, since whether a blank
+    // line precedes leading data depends on the previous chunk.
+    int last_is_instruction = -1;
+
+    out_reset(chunk->text);
+    chunk->leading_break = false;
+    chunk->failed = false;
+
+    if (!decode_chunk(d, image, size, chunk->begin, chunk->end, dec))
+    {
+        chunk->failed = true;
+        chunk->exit = chunk->begin;
+        chunk->trailing_insn = false;
+        return;
+    }
+
+    size_t i;
+    for (i = chunk->begin; i < chunk->end && i < size; )
+    {
+        if (is_instruction_start(d, i))
+        {
+            // The walk visits instruction starts in increasing order, and
+            // each one in [begin, end) was decoded above.
+            while (dec->offsets[k] != i)
+                k++;
+            // The batch rejects instructions longer than X86_MAX_INSN_LENGTH
+            // (a run of redundant prefixes), which a serial walk accepts,
+            // so decode a rejected instruction again on its own.
+            int count = dec->length[k];
+            if (count > 0)
+                x86_batch_get(&dec->batch, k, &insn);
+            else
+                count = x86_decode(image + i, image + size, &insn, &opts);
+            if (count <= 0)
+            {
+                out_puts(chunk->text, "CANNOT DECODE SUPPOSEDLY CODE!\n");
+                chunk->failed = true;
+                break;
+            }
+            format_xrefs(d, i, chunk->text);
+            format_insn_line(image, i, count, &insn, flags, labels, chunk->text);
+            i += count;
+            last_is_instruction = 1;
+        }
+        else
+        {
+            if (last_is_instruction < 0)
+                chunk->leading_break = true;
+            else if (last_is_instruction > 0)
+                out_putc(chunk->text, '\n');
+            last_is_instruction = 0;
+            i++;
+        }
+    }
+    chunk->exit = i;
+    chunk->trailing_insn = (last_is_instruction > 0);
+}
+
+// State shared by the writer and the worker threads. Chunk k is formatted
+// into slot k % window, so a worker may only take chunk k once the writer
+// has written chunk k - window.
+struct listing_job_t
+{
+    x86_dasm_t *d;
+    const unsigned char *image;
+    size_t size;
+    unsigned int flags;
+    const label_cache_t *labels;
+    std::vector<listing_chunk_t> *chunks;
+    size_t window;              // number of chunks formatted ahead at most
+
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t next;                // next chunk to format
+    size_t written;             // number of chunks written out
+    std::vector<char> done;     // whether each chunk is formatted
+    bool stop;                  // the writer gave up
+};
+
+static void listing_worker(listing_job_t *job)
+{
+    chunk_decoder_t dec;
+    size_t count = job->chunks->size();
+    std::unique_lock<std::mutex> lock(job->lock);
+    for (;;)
+    {
+        while (!job->stop && job->next < count &&
+               job->next >= job->written + job->window)
+            job->changed.wait(lock);
+        if (job->stop || job->next >= count)
+            break;
+
+        size_t k = job->next++;
+        lock.unlock();
+        format_chunk(job->d, job->image, job->size, job->flags, job->labels,
+                     &dec, &(*job->chunks)[k]);
+        lock.lock();
+        job->done[k] = 1;
+        job->changed.notify_all();
+    }
+}
+
+static bool list_chunks(
+    x86_dasm_t *d,
+    const unsigned char *image,
+    size_t size,
+    out_sink_t *out,
+    unsigned int flags,
+    unsigned int thread_count)
+{
+    // Split the image into chunks. Each chunk starts at an instruction
+    // boundary or at a byte that is not code, so that the walk started
+    // there agrees with a serial walk in all but pathological cases,
+    // e.g. overlapping instructions. These are fixed up below.
+    std::vector<listing_chunk_t> chunks;
+    size_t begin = 0;
+    while (begin < size)
+    {
+        size_t end = begin + LISTING_CHUNK_SIZE;
+        while (end < size && (dasm_get_byte_attr(d, (uint32_t)end) & ATTR_TYPE) == TYPE_CODE
+                          && !is_instruction_start(d, end))
+            end++;
+        if (end > size)
+            end = size;
+
+        listing_chunk_t chunk;
+        chunk.begin = begin;
+        chunk.end = end;
+        chunk.text = NULL;
+        chunks.push_back(chunk);
+        begin = end;
+    }
+
+    if (thread_count == 0)
+        thread_count = std::thread::hardware_concurrency();
+    if (thread_count == 0)
+        thread_count = 1;
+    if (thread_count > chunks.size())
+        thread_count = (unsigned int)chunks.size();
+
+    // Formatted text is held in a fixed set of memory sinks, reused as the
+    // writer catches up, so the whole listing is never in memory at once.
+    size_t window = (size_t)thread_count * LISTING_CHUNKS_AHEAD;
+    if (window > chunks.size())
+        window = chunks.size();
+    std::vector<out_sink_t *> slots(window);
+    bool ok = true;
+    for (size_t k = 0; k < window; k++)
+    {
+        slots[k] = out_open_memory();
+        if (slots[k] == NULL)
+            ok = false;
+    }
+    for (size_t k = 0; k < chunks.size(); k++)
+        chunks[k].text = slots[k % window];
+
+    label_cache_t labels;
+    if (flags & LISTING_LABELS)
+        build_label_cache(d, size, &labels);
+
+    listing_job_t job;
+    job.d = d;
+    job.image = image;
+    job.size = size;
+    job.flags = flags;
+    job.labels = &labels;
+    job.chunks = &chunks;
+    job.window = window;
+    job.next = 0;
+    job.written = 0;
+    job.done.assign(chunks.size(), 0);
+    job.stop = !ok;
+
+    // With a single thread the writer formats each chunk itself; otherwise
+    // the workers format chunks ahead while this thread writes them out.
+    // Nothing below may throw while workers are running; if a thread
+    // cannot be started, the ones already running do the work.
+    std::vector<std::thread> workers;
+    if (thread_count > 1 && ok)
+    {
+        workers.reserve(thread_count);
+        for (unsigned int t = 0; t < thread_count; t++)
+        {
+            try
+            {
+                workers.push_back(std::thread(listing_worker, &job));
+            }
+            catch (const std::exception &)
+            {
+                break;
+            }
+        }
+    }
+
+    // Write out the chunks in address order as soon as each is formatted.
+    // If the previous chunk's walk stepped past the start of this chunk,
+    // list it again from where that walk stopped.
+    chunk_decoder_t dec;
+    bool last_is_instruction = false;
+    size_t pos = 0;
+    for (size_t k = 0; k < chunks.size() && ok; k++)
+    {
+        listing_chunk_t &chunk = chunks[k];
+        if (workers.empty())
+        {
+            format_chunk(d, image, size, flags, &labels, &dec, &chunk);
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(job.lock);
+            while (!job.done[k])
+                job.changed.wait(lock);
+        }
+
+        if (pos < chunk.end)
+        {
+            if (pos != chunk.begin)
+            {
+                chunk.begin = pos;
+                format_chunk(d, image, size, flags, &labels, &dec, &chunk);
+            }
+
+            size_t n;
+            const char *text = out_data(chunk.text, &n);
+            if (text == NULL)
+            {
+                ok = false;
+            }
+            else
+            {
+                if (chunk.leading_break && last_is_instruction)
+                    out_putc(out, '\n');
+                out_write(out, text, n);
+                if (chunk.failed)
+                    ok = false;
+                last_is_instruction = chunk.trailing_insn;
+                pos = chunk.exit;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(job.lock);
+        job.written = k + 1;
+        job.stop = !ok;
+        job.changed.notify_all();
+    }
+
+    if (!workers.empty())
+    {
+        {
+            std::lock_guard<std::mutex> lock(job.lock);
+            job.stop = true;
+            job.changed.notify_all();
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+    }
+
+    for (size_t k = 0; k < window; k++)
+        out_close(slots[k]);
+    return ok;
+}
+
+int write_listing(
+    x86_dasm_t *d,
+    const unsigned char *image,
+    size_t size,
+    out_sink_t *out,
+    unsigned int flags,
+    unsigned int thread_count)
+{
+    try
+    {
+        return list_chunks(d, image, size, out, flags, thread_count)? 1 : 0;
+    }
+    catch (const std::bad_alloc &)
+    {
+        return 0;
+    }
+}
+
+// Line index of a listing, built once after the analysis.
+struct listing_index_t
+{
+    x86_dasm_t *d;
+    const unsigned char *image;
+    size_t size;
+    std::vector<listing_line_t> lines;
+    label_cache_t labels;
+};
+
+static void add_line(listing_index_t *index, size_t address, int kind, int length, int group)
+{
+    listing_line_t line;
+    line.address = (uint32_t)address;
+    line.kind = (uint8_t)kind;
+    line.group = (uint8_t)group;
+    line.length = (uint16_t)((length < 0xFFFF)? length : 0xFFFF);
+    index->lines.push_back(line);
+}
+
+// Adds the lines of the listing to the index. Throws std::bad_alloc if
+// out of memory.
+static void index_lines(listing_index_t *index)
+{
+    x86_dasm_t *d = index->d;
+    const unsigned char *image = index->image;
+    size_t size = index->size;
+    x86_options_t opts = { OPR_16BIT };
+
+    // Walk the image the same way as format_chunk() does, but only
+    // compute instruction lengths and count xref lines.
+    bool last_is_instruction = false;
+    for (size_t i = 0; i < size; )
+    {
+        if (is_instruction_start(d, i))
+        {
+            int count = x86_insn_length(image + i, image + size, &opts, NULL);
+            if (count <= 0)
+            {
+                add_line(index, i, LINE_ERROR, 0, 0);
+                break;
+            }
+
+            const dasm_xref_t *xref = dasm_enum_xrefs(d, (uint32_t)i, NULL);
+            if (xref)
+            {
+                add_line(index, i, LINE_BLANK, 0, 0);
+                for (int group = 0; xref; group++)
+                {
+                    add_line(index, i, LINE_XREF, 0, group);
+                    dasm_xref_type type = xref->type;
+                    while (xref && xref->type == type)
+                        xref = dasm_enum_xrefs(d, (uint32_t)i, xref);
+                }
+            }
+
+            add_line(index, i, LINE_INSN, count, 0);
+            i += count;
+            last_is_instruction = true;
+        }
+        else
+        {
+            if (last_is_instruction)
+                add_line(index, i, LINE_BLANK, 0, 0);
+            last_is_instruction = false;
+            i++;
+        }
+    }
+}
+
+listing_index_t *listing_index_create(
+    x86_dasm_t *d,
+    const unsigned char *image,
+    size_t size)
+{
+    listing_index_t *index = new (std::nothrow) listing_index_t;
+    if (index == NULL)
+        return NULL;
+    index->d = d;
+    index->image = image;
+    index->size = size;
+
+    try
+    {
+        build_label_cache(d, size, &index->labels);
+        index_lines(index);
+    }
+    catch (const std::bad_alloc &)
+    {
+        delete index;
+        return NULL;
+    }
+    return index;
+}
+
+void listing_index_destroy(listing_index_t *index)
+{
+    delete index;
+}
+
+size_t listing_line_count(const listing_index_t *index)
+{
+    return index->lines.size();
+}
+
+const listing_line_t *listing_get_line(const listing_index_t *index, size_t n)
+{
+    return (n < index->lines.size())? &index->lines[n] : NULL;
+}
+
+size_t listing_find_address(const listing_index_t *index, uint32_t address)
+{
+    size_t lo = 0, hi = index->lines.size();
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->lines[mid].address < address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t format_listing_window(
+    const listing_index_t *index,
+    size_t first,
+    size_t count,
+    out_sink_t *out,
+    unsigned int flags)
+{
+    x86_options_t opts = { OPR_16BIT };
+    x86_insn_t insn;
+
+    if (first >= index->lines.size())
+        return 0;
+    if (count > index->lines.size() - first)
+        count = index->lines.size() - first;
+
+    for (size_t n = first; n < first + count; n++)
+    {
+        const listing_line_t &line = index->lines[n];
+        size_t i = line.address;
+        switch (line.kind)
+        {
+        case LINE_BLANK:
+            out_putc(out, '\n');
+            break;
+
+        case LINE_XREF:
+            {
+                // Skip the xrefs of the preceding type groups.
+                const dasm_xref_t *xref = dasm_enum_xrefs(index->d, line.address, NULL);
+                for (int group = 0; group < line.group; group++)
+                {
+                    dasm_xref_type type = xref->type;
+                    while (xref->type == type)
+                        xref = dasm_enum_xrefs(index->d, line.address, xref);
+                }
+                format_xref_line(index->d, i, xref, line.group == 0, out);
+            }
+            break;
+
+        case LINE_INSN:
+            {
+                // Take the length from the decoder, since line.length
+                // saturates.
+                int length = x86_decode(index->image + i,
+                                        index->image + index->size, &insn, &opts);
+                format_insn_line(index->image, i, length, &insn, flags,
+                                 &index->labels, out);
+            }
+            break;
+
+        case LINE_ERROR:
+            out_puts(out, "CANNOT DECODE SUPPOSEDLY CODE!\n");
+            break;
+        }
+    }
+    return count;
+}
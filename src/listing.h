@@ -0,0 +1,106 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stdint.h>
+#include "disassembler.h"
+#include "output.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Flags for write_listing(). */
+#define LISTING_BYTES   1   /* show the first 8 bytes of each instruction
+                             * in hexadecimal after the address */
+#define LISTING_LABELS  2   /* show branch targets and far pointers that
+                             * have xrefs as their loc_XXXX labels */
+
+/* Writes the linear listing of an analyzed image to an output sink.
+ *
+ * The image is split into chunks that start at instruction boundaries.
+ * Worker threads decode and format the chunks into private buffers, and
+ * the calling thread writes each chunk out as soon as it and all chunks
+ * before it are formatted, so that the output is identical to that of a
+ * single-threaded listing. Only a few chunks per thread are formatted ahead
+ * of the output. If thread_count is zero, one thread is used per hardware
+ * thread.
+ *
+ * Returns non-zero if the listing is complete, or zero if it stopped at a
+ * byte marked as code that cannot be decoded or ran out of memory.
+ */
+int write_listing(
+    x86_dasm_t *d,                  /* analyzed disassembler object */
+    const unsigned char *image,     /* executable image */
+    size_t size,                    /* size of the image in bytes */
+    out_sink_t *out,                /* output sink */
+    unsigned int flags,             /* LISTING_xxx flags */
+    unsigned int thread_count);     /* number of worker threads, or zero */
+
+/* Kinds of lines in a listing. */
+enum listing_line_kind
+{
+    LINE_BLANK  = 0,    /* empty line before xrefs or between code and data */
+    LINE_XREF   = 1,    /* xrefs of one type to an instruction */
+    LINE_INSN   = 2,    /* an instruction */
+    LINE_ERROR  = 3     /* code that cannot be decoded; ends the listing */
+};
+
+/* Describes one line of a listing. */
+typedef struct listing_line_t
+{
+    uint32_t address;   /* offset of the byte the line refers to */
+    uint8_t kind;       /* enum listing_line_kind */
+    uint8_t group;      /* ordinal of the xref type among the xrefs to the
+                         * instruction, for LINE_XREF; the first one also
+                         * carries the label */
+    uint16_t length;    /* length of the instruction, for LINE_INSN; a run
+                         * of redundant prefixes can make it longer than
+                         * X86_MAX_INSN_LENGTH, and it saturates at 0xFFFF */
+} listing_line_t;
+
+/* An opaque structure that indexes the lines of a listing, so that any
+ * range of lines can be formatted without formatting those before it.
+ */
+typedef struct listing_index_t listing_index_t;
+
+/* Builds the line index of an analyzed image. This takes one pass over the
+ * image, which only computes instruction lengths. The disassembler and the
+ * image must stay alive while the index is used. Returns NULL if out of
+ * memory.
+ */
+listing_index_t *listing_index_create(
+    x86_dasm_t *d,
+    const unsigned char *image,
+    size_t size);
+
+/* Destroys a line index. */
+void listing_index_destroy(listing_index_t *index);
+
+/* Returns the number of lines in the listing. */
+size_t listing_line_count(const listing_index_t *index);
+
+/* Returns the description of line n, or NULL if n is out of range. */
+const listing_line_t *listing_get_line(const listing_index_t *index, size_t n);
+
+/* Returns the first line that refers to an address at or after _address_,
+ * or the line count if there is none.
+ */
+size_t listing_find_address(const listing_index_t *index, uint32_t address);
+
+/* Formats the lines _first_ to _first_ + _count_ - 1 of the listing, which
+ * are identical to the corresponding lines written by write_listing(). The
+ * cost is proportional to the number of lines formatted. Returns the number
+ * of lines written, which is less than _count_ at the end of the listing.
+ */
+size_t format_listing_window(
+    const listing_index_t *index,   /* line index */
+    size_t first,                   /* first line to format */
+    size_t count,                   /* number of lines to format */
+    out_sink_t *out,                /* output sink */
+    unsigned int flags);            /* LISTING_xxx flags */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LISTING_H */
@@ -1,29 +1,33 @@
-#include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <utility>
+#include <vector>
 
 #include "x86codec/x86_codec.h"
 #include "mz.h"
 #include "disassembler.h"
+#include "export.h"
+#include "listing.h"
+#include "output.h"
+#include "trace.h"
 
-static void hex_dump(const void *_p, size_t size)
+static void hex_dump(out_sink_t *out, const void *_p, size_t size)
 {
-	static const char *output = "0123456789abcdef";
 	const unsigned char *p = (const unsigned char *)_p;
 
-	for (size_t i = 0; i < size; ++i)
+	for (size_t i = 0; i < size; i += 16)
 	{
-		if (i > 0 && i % 16 == 0)
-			std::cout << std::endl;
-
-		unsigned char c = p[i];
-		std::cout << output[(c>>4)&0xf] << output[c&0xf] <<  ' ';
+		if (i > 0)
+			out_putc(out, '\n');
+		out_hex_bytes(out, p + i, std::min(size - i, (size_t)16));
 	}
-	std::cout << std::endl;
+	out_putc(out, '\n');
 }
 
-static void test_decode(const unsigned char *image, size_t size, size_t start)
+static void test_decode(out_sink_t *out, const unsigned char *image, size_t size, size_t start)
 {
     const unsigned char *p = image + start;
     x86_options_t opt;
@@ -45,20 +49,20 @@ static void test_decode(const unsigned char *image, size_t size, size_t start)
         }
 
         /* Output address. */
-        printf("0000:%04X  ", (unsigned int)(p - image));
+        out_puts(out, "0000:");
+        out_hex(out, (uint32_t)(p - image), 4);
+        out_puts(out, "  ");
 
         /* Output binary code. */
-        for (int i = 0; i < 8; i++)
-        {
-            if (i < count)
-                printf("%02x ", p[i]);
-            else
-                printf("   ");
-        }
+        int n = (count < 8)? count : 8;
+        out_hex_bytes(out, p, n);
+        for (int i = n; i < 8; i++)
+            out_puts(out, "   ");
 
         char text[256];
         x86_format(&insn, text, X86_FMT_INTEL|X86_FMT_LOWER);
-        std::cout << text << std::endl;
+        out_puts(out, text);
+        out_putc(out, '\n');
         if (text[0] == '*')
             __debugbreak();
         else
@@ -66,118 +70,411 @@ static void test_decode(const unsigned char *image, size_t size, size_t start)
     }
 }
 
-static void test_dasm(const unsigned char *image, size_t size, mz_farptr_t start)
+enum run_mode
 {
-    x86_dasm_t *d;
-    x86_insn_t insn;
-    x86_options_t opts = { OPR_16BIT };
+    MODE_DECODE,    // decode linearly from the entry point, no analysis
+    MODE_ANALYZE,   // analyze only
+    MODE_LIST,      // analyze, print statistics and write the listing
+    MODE_STATS,     // analyze and print statistics
+    MODE_DUMP       // hex dump of the image
+};
 
-    d = dasm_create(image, size);
-    dasm_analyze(d, start);
+struct options_t
+{
+    run_mode mode;
+    std::vector<mz_farptr_t> entries;   // empty to use the program entry
+    const char *output;                 // NULL for standard output
+    bool mapped;                        // map the output file into memory
+    unsigned int listing_flags;         // LISTING_xxx flags
+    unsigned int threads;               // 0 for one per hardware thread
+    const char *export_bin;             // binary export file, or NULL
+    const char *export_json;            // JSON-lines export file, or NULL
+    bool timing;                        // print the time of each phase
+    const char *trace;                  // Chrome trace file, or NULL
+    std::vector<const char *> files;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: reveng [options] file.exe...\n"
+        "\n"
+        "Options:\n"
+        "  -m, --mode MODE      decode, analyze, list (default), stats or dump\n"
+        "  -e, --entry SEG:OFF  start analysis (or decoding) at this address,\n"
+        "                       in hexadecimal relative to the image; may be\n"
+        "                       repeated; default is the program entry point\n"
+        "  -o, --output FILE    write the listing or dump to FILE\n"
+        "      --mmap           write the output file through a memory mapping\n"
+        "      --bytes          show instruction bytes in the listing\n"
+        "      --labels         show branch targets as labels in the listing\n"
+        "  -j, --threads N      number of threads used for the listing\n"
+        "      --export-bin FILE   export analysis results in binary format\n"
+        "      --export-json FILE  export analysis results as JSON lines\n"
+        "  -t, --time           print the time taken by each phase\n"
+        "      --trace FILE     write a timeline of the phases to FILE in\n"
+        "                       Chrome trace-event format\n"
+        "  -h, --help           print this help\n");
+}
 
-    fprintf(stderr, "\n-- Statistics --\n");
-    dasm_stat(d);
+static bool parse_farptr(const char *s, mz_farptr_t *p)
+{
+    char *end;
+    unsigned long seg = strtoul(s, &end, 16);
+    if (end == s || *end != ':')
+        return false;
+    s = end + 1;
+    unsigned long off = strtoul(s, &end, 16);
+    if (end == s || *end != 0 || seg > 0xFFFF || off > 0xFFFF)
+        return false;
+    p->seg = (uint16_t)seg;
+    p->off = (uint16_t)off;
+    return true;
+}
+
+static bool parse_count(const char *s, unsigned int *n)
+{
+    char *end;
+    if (!(*s >= '0' && *s <= '9'))
+        return false;
+    unsigned long value = strtoul(s, &end, 10);
+    if (*end != 0 || value > 0xFFFF)
+        return false;
+    *n = (unsigned int)value;
+    return true;
+}
+
+// Parses the command line. Returns false and prints a message if it is
+// invalid.
+static bool parse_options(int argc, char *argv[], options_t *opts)
+{
+    opts->mode = MODE_LIST;
+    opts->output = NULL;
+    opts->mapped = false;
+    opts->listing_flags = 0;
+    opts->threads = 0;
+    opts->export_bin = NULL;
+    opts->export_json = NULL;
+    opts->timing = false;
+    opts->trace = NULL;
 
-    // Linear listing of disassemblies.
-    bool last_is_instruction = false;
-    for (size_t i = 0; i < size; )
+    for (int i = 1; i < argc; i++)
     {
-        byte_attr_t attr = dasm_get_byte_attr(d, i);
-        if ((attr & ATTR_TYPE) == TYPE_CODE && (attr & ATTR_BOUNDARY))
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc)? argv[i + 1] : NULL;
+
+#define OPTION(short_name, long_name) \
+    (strcmp(arg, short_name) == 0 || strcmp(arg, long_name) == 0)
+#define REQUIRE_VALUE() \
+    do { \
+        if (value == NULL) { \
+            fprintf(stderr, "Option %s expects a value.\n", arg); \
+            return false; \
+        } \
+        i++; \
+    } while (0)
+
+        if (OPTION("-m", "--mode"))
         {
-            int count = x86_decode(image + i, image + size, &insn, &opts);
-            if (count > 0)
+            REQUIRE_VALUE();
+            if (strcmp(value, "decode") == 0)
+                opts->mode = MODE_DECODE;
+            else if (strcmp(value, "analyze") == 0)
+                opts->mode = MODE_ANALYZE;
+            else if (strcmp(value, "list") == 0)
+                opts->mode = MODE_LIST;
+            else if (strcmp(value, "stats") == 0)
+                opts->mode = MODE_STATS;
+            else if (strcmp(value, "dump") == 0)
+                opts->mode = MODE_DUMP;
+            else
             {
-                char text[256];
-                x86_format(&insn, text, X86_FMT_LOWER|X86_FMT_INTEL);
-
-                // Try find xref to this instruction.
-                const dasm_xref_t *xref = dasm_enum_xrefs(d, i, NULL);
-                if (xref)
-                {
-                    dasm_xref_type type = xref->type;
-                    char comment[256];
-                    sprintf(comment, "loc_%X:", i);
-                    printf("\n%-10s ; %s:", comment, dasm_xref_type_string(type));
-                    while (xref)
-                    {
-                        printf(" %04X:%04X", xref->source.seg, xref->source.off);
-                        xref = dasm_enum_xrefs(d, i, xref);
-                        if (xref && xref->type != type)
-                        {
-                            type = xref->type;
-                            printf("\n%-10s ; %s:", "", dasm_xref_type_string(type));
-                        }
-                    }
-                    printf("\n");
-                }
-
-                printf("%04X:%04X  %s\n", 0, i, text);
-                i += count;
+                fprintf(stderr, "Unknown mode: %s\n", value);
+                return false;
             }
-            else
+        }
+        else if (OPTION("-e", "--entry"))
+        {
+            REQUIRE_VALUE();
+            mz_farptr_t entry;
+            if (!parse_farptr(value, &entry))
             {
-                printf("CANNOT DECODE SUPPOSEDLY CODE!\n");
-                return;
+                fprintf(stderr, "Invalid entry point: %s\n", value);
+                return false;
             }
-            last_is_instruction = true;
+            opts->entries.push_back(entry);
         }
-        else
+        else if (OPTION("-o", "--output"))
+        {
+            REQUIRE_VALUE();
+            opts->output = value;
+        }
+        else if (OPTION("-j", "--threads"))
+        {
+            REQUIRE_VALUE();
+            if (!parse_count(value, &opts->threads))
+            {
+                fprintf(stderr, "Invalid number of threads: %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--export-bin") == 0)
+        {
+            REQUIRE_VALUE();
+            opts->export_bin = value;
+        }
+        else if (strcmp(arg, "--export-json") == 0)
         {
-            if (last_is_instruction)
-                printf("\n");
-            last_is_instruction = false;
-            i++;
+            REQUIRE_VALUE();
+            opts->export_json = value;
         }
+        else if (strcmp(arg, "--trace") == 0)
+        {
+            REQUIRE_VALUE();
+            opts->trace = value;
+        }
+        else if (strcmp(arg, "--mmap") == 0)
+            opts->mapped = true;
+        else if (strcmp(arg, "--bytes") == 0)
+            opts->listing_flags |= LISTING_BYTES;
+        else if (strcmp(arg, "--labels") == 0)
+            opts->listing_flags |= LISTING_LABELS;
+        else if (OPTION("-t", "--time"))
+            opts->timing = true;
+        else if (OPTION("-h", "--help"))
+            return false;
+        else if (arg[0] == '-' && arg[1] != 0)
+        {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return false;
+        }
+        else
+            opts->files.push_back(arg);
+
+#undef OPTION
+#undef REQUIRE_VALUE
     }
+
+    if (opts->files.empty())
+    {
+        fprintf(stderr, "Expecting file name as argument.\n");
+        return false;
+    }
+    if ((opts->export_bin || opts->export_json) && opts->files.size() > 1)
+    {
+        fprintf(stderr, "Export options take a single input file.\n");
+        return false;
+    }
+    return true;
 }
 
-int main(int argc, char* argv[])
+// Measures the wall time of the phases of a run.
+class phase_timer
 {
-#if 0
-	if (argc <= 1)
-	{
-		std::cerr << "Expecting file name as first argument.\n";
-		return 1;
-	}
-#endif
+public:
+    explicit phase_timer(bool print)
+        : enabled(print), start(std::chrono::steady_clock::now()) { }
+
+    // Prints the time since the previous call, or since construction.
+    void lap(const char *phase)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (enabled)
+        {
+            double ms = std::chrono::duration<double, std::milli>(now - start).count();
+            fprintf(stderr, "%-10s %10.3f ms\n", phase, ms);
+        }
+        start = now;
+    }
 
-	const char *filename = "data/H.EXE";
+private:
+    bool enabled;
+    std::chrono::steady_clock::time_point start;
+};
+
+static bool export_results(
+    x86_dasm_t *d, const unsigned char *image, size_t size, const options_t &opts)
+{
+    out_sink_t *bin = NULL, *json = NULL;
+    if (opts.export_bin && (bin = out_open_file(opts.export_bin, OUT_DIRECT)) == NULL)
+    {
+        fprintf(stderr, "Cannot create %s.\n", opts.export_bin);
+        return false;
+    }
+    if (opts.export_json && (json = out_open_file(opts.export_json, OUT_DIRECT)) == NULL)
+    {
+        fprintf(stderr, "Cannot create %s.\n", opts.export_json);
+        out_close(bin);
+        return false;
+    }
+
+    bool ok = true;
+    if (!dasm_export(d, image, size, bin, json))
+    {
+        fprintf(stderr, "Out of memory while exporting.\n");
+        ok = false;
+    }
+    if (bin && out_close(bin) != 0)
+    {
+        fprintf(stderr, "Cannot write %s.\n", opts.export_bin);
+        ok = false;
+    }
+    if (json && out_close(json) != 0)
+    {
+        fprintf(stderr, "Cannot write %s.\n", opts.export_json);
+        ok = false;
+    }
+    return ok;
+}
+
+// Processes one executable as selected by the options. Returns false on
+// error.
+static bool process_file(const char *filename, const options_t &opts, out_sink_t *out)
+{
+    phase_timer timer(opts.timing);
 
     /* Open the .EXE file. */
     mz_file_t *file = mz_open(filename);
     if (!file)
     {
-		std::cerr << "The file format is not supported." << std::endl;
-		return 1;
-	}
-	// std::cout << "Image size: " << reader.image_size() << std::endl;
-
-    // Decode from a specific address.
-#if 1
-    //size_t start = 0x7430; // This is program entry
-    mz_farptr_t start = mz_program_entry(file);
-    // start.seg = 0;
-#elif 0
-    size_t start = 0x0010; // first instruction
-#elif 0
-    //size_t start = 0x3770; // near a jump table
-    size_t start = 0x37B4; // after jump table
-#else
-    size_t start = 0x17fc; // This is proc OutputDecodedPage
-#endif
+        fprintf(stderr, "%s: The file format is not supported.\n", filename);
+        return false;
+    }
+    const unsigned char *image = mz_image_address(file);
+    size_t size = mz_image_size(file);
+    timer.lap("load");
 
-#if 0
-    // Decode instructions in serial from the starting position.
-    test_decode(mz_image_address(file), mz_image_size(file), start);
-#else
-    // Disassemble the executable from a starting address.
-    test_dasm(mz_image_address(file), mz_image_size(file), start);
-    //test_dasm(mz_image_address(file), mz_image_size(file), 0x751C);
-#endif
+    std::vector<mz_farptr_t> entries = opts.entries;
+    if (entries.empty())
+        entries.push_back(mz_program_entry(file));
+
+    // Entry points outside the image are reported and skipped in every
+    // mode that starts from them.
+    bool ok = true;
+    if (opts.mode != MODE_DUMP)
+    {
+        size_t n = 0;
+        for (size_t k = 0; k < entries.size(); k++)
+        {
+            size_t start = (size_t)entries[k].seg * 16 + entries[k].off;
+            if (start >= size)
+            {
+                fprintf(stderr, "%s: Entry point %04X:%04X is outside the image.\n",
+                        filename, entries[k].seg, entries[k].off);
+                ok = false;
+                continue;
+            }
+            entries[n++] = entries[k];
+        }
+        entries.resize(n);
+    }
 
-	// Produce a hex-dump of the first few bytes of the image.
-	// hex_dump(reader.image_address(), std::min(reader.image_size(), (size_t)256));
+    if (opts.mode == MODE_DUMP)
+    {
+        hex_dump(out, image, size);
+        timer.lap("dump");
+    }
+    else if (opts.mode == MODE_DECODE)
+    {
+        for (size_t k = 0; k < entries.size(); k++)
+        {
+            size_t start = (size_t)entries[k].seg * 16 + entries[k].off;
+            test_decode(out, image, size, start);
+        }
+        timer.lap("decode");
+    }
+    else
+    {
+        // The analysis reports problems on stdout through stdio. Keep them
+        // in order with what the sink has buffered so far.
+        out_flush(out);
+        x86_dasm_t *d = dasm_create(image, size);
+        if (d == NULL)
+        {
+            fprintf(stderr, "%s: Out of memory.\n", filename);
+            mz_close(file);
+            return false;
+        }
+        for (size_t k = 0; k < entries.size(); k++)
+            dasm_analyze(d, entries[k]);
+        fflush(stdout);
+        timer.lap("analyze");
 
-	return 0;
+        if (opts.mode == MODE_LIST || opts.mode == MODE_STATS)
+        {
+            fprintf(stderr, "\n-- Statistics --\n");
+            dasm_stat(d);
+            timer.lap("stats");
+        }
+
+        if (opts.mode == MODE_LIST)
+        {
+            // Linear listing of disassemblies.
+            trace_span_t span;
+            trace_begin(&span, "listing", NULL);
+            if (!write_listing(d, image, size, out, opts.listing_flags, opts.threads))
+                ok = false;
+            trace_end(&span, NULL);
+            timer.lap("list");
+        }
+
+        if (opts.export_bin || opts.export_json)
+        {
+            trace_span_t span;
+            trace_begin(&span, "export", NULL);
+            if (!export_results(d, image, size, opts))
+                ok = false;
+            trace_end(&span, NULL);
+            timer.lap("export");
+        }
+        dasm_destroy(d);
+    }
+
+    mz_close(file);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    options_t opts;
+    if (!parse_options(argc, argv, &opts))
+    {
+        usage();
+        return 1;
+    }
+
+    // Listings and dumps go to standard output unless a file is given.
+    out_sink_t *out;
+    if (opts.output)
+        out = out_open_file(opts.output, opts.mapped? OUT_MAPPED : OUT_DIRECT);
+    else
+        out = out_open_fd(1);
+    if (out == NULL)
+    {
+        fprintf(stderr, "Cannot open %s.\n", opts.output? opts.output : "standard output");
+        return 1;
+    }
+
+    if (opts.trace)
+        trace_start();
+
+    int result = 0;
+    for (size_t i = 0; i < opts.files.size(); i++)
+    {
+        if (!process_file(opts.files[i], opts, out))
+            result = 1;
+    }
+
+    if (out_close(out) != 0)
+    {
+        fprintf(stderr, "Cannot write %s.\n", opts.output? opts.output : "standard output");
+        result = 1;
+    }
+
+    if (opts.trace && trace_write(opts.trace) != 0)
+    {
+        fprintf(stderr, "Cannot write %s.\n", opts.trace);
+        result = 1;
+    }
+    return result;
 }
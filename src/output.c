@@ -0,0 +1,457 @@
+/* output.c -- buffered output sink for listings */
+
+#include "output.h"
+#include "hex.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define OUT_KIND_MEMORY 0   /* growable memory buffer */
+#define OUT_KIND_DIRECT 1   /* fixed buffer written to a file descriptor */
+#define OUT_KIND_MAPPED 2   /* view of a memory-mapped file */
+
+/* Size of the buffer of a direct sink. */
+#define OUT_BUFFER_SIZE (1 << 20)
+
+/* Size of each view of a mapped file. Views must start at a multiple of
+ * OUT_MAP_ALIGN, which is the allocation granularity on Windows and a
+ * multiple of the page size elsewhere.
+ */
+#define OUT_VIEW_SIZE   (16 << 20)
+#define OUT_MAP_ALIGN   (64 << 10)
+
+struct out_sink_t
+{
+    int kind;           /* OUT_KIND_xxx */
+    int error;          /* non-zero if any write has failed */
+    char *base;         /* heap buffer or mapped view */
+    char *ptr;          /* next byte to write */
+    char *end;          /* end of usable space */
+    int fd;             /* file descriptor of a direct or mapped sink */
+    int owns_fd;        /* non-zero if out_close() closes the descriptor */
+    uint64_t offset;    /* file offset of _base_ for a mapped sink */
+#ifdef _WIN32
+    HANDLE file;        /* file handle of a mapped sink */
+    HANDLE mapping;     /* mapping object of the current view */
+#endif
+    char scratch[OUT_MAX_RESERVE]; /* discarded output after an error */
+};
+
+static out_sink_t *create_sink(int kind)
+{
+    out_sink_t *s = (out_sink_t *)malloc(sizeof(out_sink_t));
+    if (s == NULL)
+        return NULL;
+    memset(s, 0, sizeof(out_sink_t));
+    s->kind = kind;
+    s->fd = -1;
+#ifdef _WIN32
+    s->file = INVALID_HANDLE_VALUE;
+#endif
+    return s;
+}
+
+/* Marks a sink as failed. From now on, output goes to the scratch buffer
+ * and is thrown away.
+ */
+static void set_error(out_sink_t *s)
+{
+    s->error = 1;
+    s->ptr = s->scratch;
+    s->end = s->scratch + sizeof(s->scratch);
+}
+
+/* Writes the whole of a block to a file descriptor. */
+static int write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+#ifdef _WIN32
+        int count = _write(fd, p, (n > 0x40000000)? 0x40000000 : (unsigned int)n);
+#else
+        ssize_t count = write(fd, p, n);
+#endif
+        if (count <= 0)
+            return -1;
+        p += count;
+        n -= (size_t)count;
+    }
+    return 0;
+}
+
+/* Maps the view of a mapped sink that starts at _offset_, extending the
+ * file as needed. Returns 0 on success, or -1 on error.
+ */
+static int map_view(out_sink_t *s, uint64_t offset)
+{
+    uint64_t file_size = offset + OUT_VIEW_SIZE;
+#ifdef _WIN32
+    s->mapping = CreateFileMappingA(s->file, NULL, PAGE_READWRITE,
+        (DWORD)(file_size >> 32), (DWORD)file_size, NULL);
+    if (s->mapping == NULL)
+        return -1;
+    s->base = (char *)MapViewOfFile(s->mapping, FILE_MAP_WRITE,
+        (DWORD)(offset >> 32), (DWORD)offset, OUT_VIEW_SIZE);
+    if (s->base == NULL)
+    {
+        CloseHandle(s->mapping);
+        s->mapping = NULL;
+        return -1;
+    }
+#else
+    void *p;
+    if (ftruncate(s->fd, (off_t)file_size) != 0)
+        return -1;
+    p = mmap(NULL, OUT_VIEW_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, s->fd, (off_t)offset);
+    if (p == MAP_FAILED)
+        return -1;
+    s->base = (char *)p;
+#endif
+    s->offset = offset;
+    return 0;
+}
+
+static void unmap_view(out_sink_t *s)
+{
+    if (s->base == NULL)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(s->base);
+    CloseHandle(s->mapping);
+    s->mapping = NULL;
+#else
+    munmap(s->base, OUT_VIEW_SIZE);
+#endif
+    s->base = NULL;
+}
+
+/* Makes room for at least n bytes after _ptr_. Returns 0 on success, or -1
+ * if the sink has failed.
+ */
+static int make_room(out_sink_t *s, size_t n)
+{
+    if (s->error)
+    {
+        s->ptr = s->scratch;
+        return -1;
+    }
+
+    switch (s->kind)
+    {
+    case OUT_KIND_MEMORY:
+        {
+            size_t used = s->ptr - s->base;
+            size_t capacity = s->end - s->base;
+            char *p;
+            capacity = (capacity < 4096)? 4096 : capacity * 2;
+            if (capacity < used + n)
+                capacity = used + n;
+            p = (char *)realloc(s->base, capacity);
+            if (p == NULL)
+                break;
+            s->base = p;
+            s->ptr = p + used;
+            s->end = p + capacity;
+            return 0;
+        }
+
+    case OUT_KIND_DIRECT:
+        if (write_all(s->fd, s->base, s->ptr - s->base) != 0)
+            break;
+        s->ptr = s->base;
+        if ((size_t)(s->end - s->ptr) < n)
+            break;
+        return 0;
+
+    case OUT_KIND_MAPPED:
+        {
+            /* Start the next view at the aligned offset at or below the
+             * current position, so that no bytes are skipped.
+             */
+            uint64_t pos = s->offset + (s->ptr - s->base);
+            uint64_t offset = pos & ~(uint64_t)(OUT_MAP_ALIGN - 1);
+            unmap_view(s);
+            if (map_view(s, offset) != 0)
+                break;
+            s->ptr = s->base + (size_t)(pos - offset);
+            s->end = s->base + OUT_VIEW_SIZE;
+            return 0;
+        }
+    }
+
+    set_error(s);
+    return -1;
+}
+
+out_sink_t *out_open_memory(void)
+{
+    return create_sink(OUT_KIND_MEMORY);
+}
+
+out_sink_t *out_open_fd(int fd)
+{
+    out_sink_t *s = create_sink(OUT_KIND_DIRECT);
+    if (s == NULL)
+        return NULL;
+    s->base = (char *)malloc(OUT_BUFFER_SIZE);
+    if (s->base == NULL)
+    {
+        free(s);
+        return NULL;
+    }
+    s->ptr = s->base;
+    s->end = s->base + OUT_BUFFER_SIZE;
+    s->fd = fd;
+    return s;
+}
+
+out_sink_t *out_open_file(const char *filename, int flags)
+{
+    out_sink_t *s;
+    int fd;
+
+    if (flags & OUT_MAPPED)
+    {
+        s = create_sink(OUT_KIND_MAPPED);
+        if (s == NULL)
+            return NULL;
+#ifdef _WIN32
+        s->file = CreateFileA(filename, GENERIC_READ|GENERIC_WRITE, 0, NULL,
+            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (s->file == INVALID_HANDLE_VALUE)
+        {
+            free(s);
+            return NULL;
+        }
+#else
+        s->fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0666);
+        if (s->fd < 0)
+        {
+            free(s);
+            return NULL;
+        }
+        s->owns_fd = 1;
+#endif
+        if (map_view(s, 0) != 0)
+        {
+            out_close(s);
+            return NULL;
+        }
+        s->ptr = s->base;
+        s->end = s->base + OUT_VIEW_SIZE;
+        return s;
+    }
+
+#ifdef _WIN32
+    fd = _open(filename, _O_WRONLY|_O_CREAT|_O_TRUNC|_O_BINARY, _S_IREAD|_S_IWRITE);
+#else
+    fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+#endif
+    if (fd < 0)
+        return NULL;
+    s = out_open_fd(fd);
+    if (s == NULL)
+    {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+        return NULL;
+    }
+    s->owns_fd = 1;
+    return s;
+}
+
+int out_flush(out_sink_t *s)
+{
+    if (s->kind == OUT_KIND_DIRECT && !s->error)
+    {
+        if (write_all(s->fd, s->base, s->ptr - s->base) != 0)
+            set_error(s);
+        else
+            s->ptr = s->base;
+    }
+    return s->error? -1 : 0;
+}
+
+int out_close(out_sink_t *s)
+{
+    int result;
+
+    if (s == NULL)
+        return -1;
+
+    out_flush(s);
+    if (s->kind == OUT_KIND_MAPPED)
+    {
+        /* Cut the file down to the size actually written. */
+        uint64_t size = s->offset;
+        if (!s->error && s->base != NULL)
+            size += s->ptr - s->base;
+        unmap_view(s);
+#ifdef _WIN32
+        if (s->file != INVALID_HANDLE_VALUE)
+        {
+            LARGE_INTEGER pos;
+            pos.QuadPart = (LONGLONG)size;
+            if (!SetFilePointerEx(s->file, pos, NULL, FILE_BEGIN) ||
+                !SetEndOfFile(s->file))
+                s->error = 1;
+            CloseHandle(s->file);
+        }
+#else
+        if (s->fd >= 0 && ftruncate(s->fd, (off_t)size) != 0)
+            s->error = 1;
+#endif
+    }
+    else
+    {
+        free(s->base);
+    }
+
+    if (s->owns_fd)
+    {
+#ifdef _WIN32
+        if (_close(s->fd) != 0)
+#else
+        if (close(s->fd) != 0)
+#endif
+            s->error = 1;
+    }
+
+    result = s->error? -1 : 0;
+    free(s);
+    return result;
+}
+
+const char *out_data(const out_sink_t *s, size_t *size)
+{
+    if (s->kind != OUT_KIND_MEMORY || s->error)
+    {
+        *size = 0;
+        return NULL;
+    }
+    *size = s->ptr - s->base;
+    return (s->base != NULL)? s->base : "";
+}
+
+void out_reset(out_sink_t *s)
+{
+    if (s->kind == OUT_KIND_MEMORY && !s->error)
+        s->ptr = s->base;
+}
+
+char *out_reserve(out_sink_t *s, size_t n)
+{
+    if ((size_t)(s->end - s->ptr) < n)
+        make_room(s, n);
+    return s->ptr;
+}
+
+void out_commit(out_sink_t *s, size_t n)
+{
+    if (s->error)
+        s->ptr = s->scratch;
+    else
+        s->ptr += n;
+}
+
+void out_write(out_sink_t *s, const void *data, size_t n)
+{
+    const char *p = (const char *)data;
+    while (n > 0)
+    {
+        size_t count = s->end - s->ptr;
+        if (count == 0)
+        {
+            if (make_room(s, (n < OUT_MAX_RESERVE)? n : OUT_MAX_RESERVE) != 0)
+                return;
+            continue;
+        }
+        if (count > n)
+            count = n;
+        memcpy(s->ptr, p, count);
+        s->ptr += count;
+        p += count;
+        n -= count;
+    }
+}
+
+void out_puts(out_sink_t *s, const char *str)
+{
+    out_write(s, str, strlen(str));
+}
+
+void out_putc(out_sink_t *s, char c)
+{
+    if (s->ptr == s->end && make_room(s, 1) != 0)
+        return;
+    *s->ptr++ = c;
+}
+
+void out_pad(out_sink_t *s, const char *str, int width)
+{
+    size_t len = strlen(str);
+    out_write(s, str, len);
+    for (; (int)len < width; len++)
+        out_putc(s, ' ');
+}
+
+void out_hex(out_sink_t *s, uint32_t value, int width)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    char buf[8];
+    int n = 0;
+
+    do
+    {
+        buf[7 - n] = digits[value & 0xf];
+        value >>= 4;
+        n++;
+    } while (value != 0);
+    for (; width > n; width--)
+        out_putc(s, '0');
+    out_write(s, buf + 8 - n, n);
+}
+
+void out_dec(out_sink_t *s, uint32_t value)
+{
+    char buf[10];
+    int n = 0;
+
+    do
+    {
+        buf[9 - n] = (char)('0' + value % 10);
+        value /= 10;
+        n++;
+    } while (value != 0);
+    out_write(s, buf + 10 - n, n);
+}
+
+void out_hex_bytes(out_sink_t *s, const void *data, size_t n)
+{
+    /* Encode in slices that fit in a reservation; keep the slice size a
+     * multiple of 32 so that the vector kernels cover all but the tail.
+     */
+    const size_t slice = (OUT_MAX_RESERVE / 3) & ~(size_t)31;
+    const unsigned char *p = (const unsigned char *)data;
+    while (n > 0)
+    {
+        size_t count = (n < slice)? n : slice;
+        hex_encode(out_reserve(s, HEX_ENCODED_SIZE(count)), p, count);
+        out_commit(s, HEX_ENCODED_SIZE(count));
+        p += count;
+        n -= count;
+    }
+}
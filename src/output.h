@@ -0,0 +1,98 @@
+/* output.h -- buffered output sink for listings */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An opaque structure that collects output in a large buffer and passes it
+ * on in big blocks. A sink never flushes on its own accord except when its
+ * buffer is full. Errors are sticky: once a write fails, further output is
+ * discarded and out_close() reports the failure.
+ */
+typedef struct out_sink_t out_sink_t;
+
+/* Maximum number of bytes that may be requested by out_reserve(). */
+#define OUT_MAX_RESERVE 4096
+
+/* Flags for out_open_file(). */
+#define OUT_DIRECT      0   /* write the buffer to the file with write(2) */
+#define OUT_MAPPED      1   /* map the file into memory and format into it */
+
+/* Creates a sink that collects output in a growable memory buffer. Use
+ * out_data() to retrieve the contents.
+ */
+out_sink_t *out_open_memory(void);
+
+/* Creates a sink that writes to an open file descriptor, e.g. 1 for
+ * standard output. The descriptor is not closed by out_close().
+ */
+out_sink_t *out_open_fd(int fd);
+
+/* Creates or truncates a file and returns a sink that writes to it. */
+out_sink_t *out_open_file(const char *filename, int flags);
+
+/* Flushes any buffered output, closes the sink and frees its resources.
+ * Returns 0 if all output was written successfully, or -1 otherwise.
+ */
+int out_close(out_sink_t *s);
+
+/* Writes buffered output to the underlying file. This is a no-op for
+ * memory and mapped sinks. Returns 0 on success, or -1 on error.
+ */
+int out_flush(out_sink_t *s);
+
+/* Returns the contents of a memory sink, or NULL if an error occurred.
+ * The pointer is valid until the next write to the sink.
+ */
+const char *out_data(const out_sink_t *s, size_t *size);
+
+/* Discards the contents of a memory sink, keeping its buffer for reuse. */
+void out_reset(out_sink_t *s);
+
+/* Returns a pointer to at least n bytes of space, n <= OUT_MAX_RESERVE,
+ * into which the caller may format output directly. The output becomes
+ * part of the sink when out_commit() is called.
+ */
+char *out_reserve(out_sink_t *s, size_t n);
+
+/* Appends the first n bytes of the space returned by out_reserve(). */
+void out_commit(out_sink_t *s, size_t n);
+
+/* Appends n bytes to the output. */
+void out_write(out_sink_t *s, const void *data, size_t n);
+
+/* Appends a null-terminated string to the output. */
+void out_puts(out_sink_t *s, const char *str);
+
+/* Appends a single character to the output. */
+void out_putc(out_sink_t *s, char c);
+
+/* Appends a string, left-justified and padded with spaces to _width_
+ * characters, like printf("%-*s").
+ */
+void out_pad(out_sink_t *s, const char *str, int width);
+
+/* Appends a value in upper-case hexadecimal, zero-padded to at least
+ * _width_ digits, like printf("%0*X").
+ */
+void out_hex(out_sink_t *s, uint32_t value, int width);
+
+/* Appends a value in decimal, like printf("%u"). */
+void out_dec(out_sink_t *s, uint32_t value);
+
+/* Appends n bytes as lower-case hexadecimal digit pairs, each followed by
+ * a space, e.g. "8b 46 fe ". See hex_encode().
+ */
+void out_hex_bytes(out_sink_t *s, const void *data, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OUTPUT_H */
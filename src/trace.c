@@ -0,0 +1,133 @@
+/* trace.c -- timeline of analysis phases in Chrome trace-event format */
+
+#include "trace.h"
+#include "output.h"
+#include "vector.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* A completed span. */
+typedef struct trace_event_t
+{
+    const char *name;
+    int64_t start;              /* nanoseconds since trace_start() */
+    int64_t duration;           /* nanoseconds */
+    int has_counters;
+    trace_counters_t counters;  /* growth of the counters during the span */
+} trace_event_t;
+
+static int tracing = 0;
+static int64_t origin;
+static VECTOR(trace_event_t) events = NULL;
+
+/* Returns a monotonic time in nanoseconds. */
+static int64_t now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (int64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void trace_start(void)
+{
+    if (events == NULL)
+        VECTOR_CREATE(events, trace_event_t);
+    VECTOR_SIZE(events) = 0;
+    origin = now_ns();
+    tracing = 1;
+}
+
+int trace_enabled(void)
+{
+    return tracing;
+}
+
+void trace_begin(trace_span_t *span, const char *name, const trace_counters_t *counters)
+{
+    span->name = name;
+    span->start = -1;
+    if (!tracing)
+        return;
+
+    span->has_counters = (counters != NULL);
+    if (counters)
+        span->base = *counters;
+    span->start = now_ns() - origin;
+}
+
+void trace_end(trace_span_t *span, const trace_counters_t *counters)
+{
+    trace_event_t e;
+    if (!tracing || span->start < 0)
+        return;
+
+    e.name = span->name;
+    e.start = span->start;
+    e.duration = now_ns() - origin - span->start;
+    e.has_counters = span->has_counters && counters;
+    if (e.has_counters)
+    {
+        e.counters.insns = counters->insns - span->base.insns;
+        e.counters.xrefs = counters->xrefs - span->base.xrefs;
+        e.counters.jump_tables = counters->jump_tables - span->base.jump_tables;
+    }
+    VECTOR_PUSH(events, e);
+}
+
+/* Writes a time in nanoseconds as microseconds with three decimals. */
+static void write_us(out_sink_t *out, int64_t ns)
+{
+    uint32_t frac = (uint32_t)(ns % 1000);
+    out_dec(out, (uint32_t)(ns / 1000));
+    out_putc(out, '.');
+    out_putc(out, (char)('0' + frac / 100));
+    out_putc(out, (char)('0' + frac / 10 % 10));
+    out_putc(out, (char)('0' + frac % 10));
+}
+
+int trace_write(const char *filename)
+{
+    out_sink_t *out;
+    size_t i;
+
+    tracing = 0;
+    out = out_open_file(filename, OUT_DIRECT);
+    if (out == NULL)
+        return -1;
+
+    out_puts(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = 0; events && i < VECTOR_SIZE(events); i++)
+    {
+        const trace_event_t *e = &VECTOR_AT(events, i);
+        out_puts(out, (i > 0)? ",\n{\"name\":\"" : "{\"name\":\"");
+        out_puts(out, e->name);
+        out_puts(out, "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":");
+        write_us(out, e->start);
+        out_puts(out, ",\"dur\":");
+        write_us(out, e->duration);
+        if (e->has_counters)
+        {
+            out_puts(out, ",\"args\":{\"insns\":");
+            out_dec(out, e->counters.insns);
+            out_puts(out, ",\"xrefs\":");
+            out_dec(out, e->counters.xrefs);
+            out_puts(out, ",\"jump_tables\":");
+            out_dec(out, e->counters.jump_tables);
+            out_putc(out, '}');
+        }
+        out_putc(out, '}');
+    }
+    out_puts(out, "\n]}\n");
+    return out_close(out);
+}
@@ -0,0 +1,60 @@
+/* trace.h -- timeline of analysis phases in Chrome trace-event format */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counters attached to a span. A span records how much each counter grew
+ * between trace_begin() and trace_end().
+ */
+typedef struct trace_counters_t
+{
+    uint32_t insns;         /* instructions decoded */
+    uint32_t xrefs;         /* xrefs pushed */
+    uint32_t jump_tables;   /* jump tables found */
+} trace_counters_t;
+
+/* A span in progress. Spans must be ended in the reverse order that they
+ * are begun, and all on the same thread.
+ */
+typedef struct trace_span_t
+{
+    const char *name;           /* name of the span; must be a literal */
+    int64_t start;              /* start time in nanoseconds, or -1 if
+                                 * tracing was off when the span began */
+    int has_counters;           /* non-zero if _base_ is valid */
+    trace_counters_t base;      /* counters when the span began */
+} trace_span_t;
+
+/* Starts recording spans. Until this is called, trace_begin() and
+ * trace_end() do nothing but test a flag.
+ */
+void trace_start(void);
+
+/* Returns non-zero if spans are being recorded. */
+int trace_enabled(void);
+
+/* Begins a span. _counters_ may be NULL if the span has no counters. */
+void trace_begin(trace_span_t *span, const char *name, const trace_counters_t *counters);
+
+/* Ends a span and records it. _counters_ must be NULL if and only if it was
+ * NULL in trace_begin().
+ */
+void trace_end(trace_span_t *span, const trace_counters_t *counters);
+
+/* Writes the recorded spans to a file as Chrome trace-event JSON, which can
+ * be opened in Perfetto or chrome://tracing, and stops recording. Returns 0
+ * on success, or -1 if the file cannot be written.
+ */
+int trace_write(const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H */
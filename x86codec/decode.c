@@ -3,51 +3,55 @@
  */
 
 #include "x86_codec.h"
-#include <memory.h>
 
-/* Specialized instruction reader. */
+#include <stdio.h>
+
+/* Specialized instruction reader. The reader never reads past _limit_: a
+ * read beyond it returns 0 but still advances _end_, so the caller detects
+ * a truncated instruction by checking for (end > limit), without copying
+ * the last few bytes of the input into a scratch buffer.
+ */
 typedef struct x86_insn_reader_t
 {
-    unsigned char buffer[20];       /* buffer used when few bytes left */
     const unsigned char *prefix;    /* pointer to beginning of instruction */
     const unsigned char *opcode;    /* pointer to opcode */
     const unsigned char *modrm;     /* pointer to modrm byte */
     const unsigned char *end;       /* pointer to end of insn + 1 */
+    const unsigned char *limit;     /* pointer to end of readable bytes */
 } x86_insn_reader_t;
 
 /* Initializes a bytecode reader to read code from a given part of memory. */
 static void 
 init_reader(x86_insn_reader_t *rd, const unsigned char *begin, const unsigned char *end)
 {
-    if (end - begin < sizeof(rd->buffer))
-    {
-        memset(rd->buffer, 0xcc, sizeof(rd->buffer)); /* debug token */
-        memcpy(rd->buffer, begin, end - begin);
-        rd->prefix = rd->buffer;
-    }
-    else
-    {
-        rd->prefix = begin;
-    }
-    rd->opcode = rd->modrm = rd->end = rd->prefix;
+    rd->opcode = rd->modrm = rd->end = rd->prefix = begin;
+    rd->limit = end;
 }
 
+/* Returns non-zero if the reader has read past the end of the input. */
+#define READER_OVERRUN(rd) ((rd)->end > (rd)->limit)
+
+/* Returns non-zero if _n_ bytes can be read at _p_. */
+#define READER_HAS(rd, p, n) ((rd)->limit - (p) >= (n))
+
 static uint8_t peek_byte(const x86_insn_reader_t *rd)
 {
-    return *rd->end;
+    return READER_HAS(rd, rd->end, 1)? *rd->end : 0;
 }
 
 static uint8_t read_byte(x86_insn_reader_t *rd)
 {
     const unsigned char *p = rd->end;
     rd->end++;
-    return *p;
+    return READER_HAS(rd, p, 1)? *p : 0;
 }
 
 static uint16_t read_word(x86_insn_reader_t *rd)
 {
     const unsigned char *p = rd->end;
     rd->end += 2;
+    if (!READER_HAS(rd, p, 2))
+        return 0;
     return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
 }
 
@@ -55,6 +59,8 @@ static uint32_t read_dword(x86_insn_reader_t *rd)
 {
     const unsigned char *p = rd->end;
     rd->end += 4;
+    if (!READER_HAS(rd, p, 4))
+        return 0;
     return (uint32_t)p[0] | ((uint32_t)p[1] << 8) 
         | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
@@ -70,7 +76,7 @@ static unsigned char read_modrm(x86_insn_reader_t *rd)
 {
     if (rd->end == rd->modrm)
         rd->end++;
-    return *rd->modrm;
+    return READER_HAS(rd, rd->modrm, 1)? *rd->modrm : 0;
 }
 
 /* Marks the next byte as ModR/M. */
@@ -94,6 +100,31 @@ static void mark_opcode(x86_insn_reader_t *rd)
 /* Returns the RM part of a ModR/M byte (0-7). */
 #define RM(b)  ((b) & 0x7)
 
+/* Returns the scale part of a SIB byte (0-3); the scaling factor is 2^scale. */
+#define SIB_SCALE(b) (((b) >> 6) & 0x3)
+
+/* Returns the index part of a SIB byte (0-7). */
+#define SIB_INDEX(b) (((b) >> 3) & 0x7)
+
+/* Returns the base part of a SIB byte (0-7). */
+#define SIB_BASE(b)  ((b) & 0x7)
+
+/* Decoder hit counters (see x86_decode_stats_t). STAT_HIT() compiles to
+ * nothing unless X86_DECODE_STATS is defined, so that the counters cost
+ * nothing in a normal build.
+ */
+#ifdef X86_DECODE_STATS
+static x86_decode_stats_t x86_stats;
+#define STAT_HIT(counter) ((void)x86_stats.counter++)
+#else
+#define STAT_HIT(counter) ((void)0)
+#endif
+
+/* Records the reason (enum x86_decode_failure) of a rejected instruction,
+ * and evaluates to -1.
+ */
+#define DECODE_FAIL(reason) (STAT_HIT(failure[reason]), -1)
+
 /*
  * Represents the encoding specification for an instruction. For performance
  * reason, the spec is stored in a 64-bit integer, as follows:
@@ -107,8 +138,9 @@ static void mark_opcode(x86_insn_reader_t *rd)
  * Byte 3: operand spec 2.
  * Byte 4: operand spec 3.
  * Byte 5: operand spec 4.
- * Byte 6: reserved; must be zero.
- * Byte 7: reserved; must be zero.
+ * Byte 6: if the instruction is an opcode extension, the row in the opcode
+ *         extension table (x86_opcode_ext_map) to look up; otherwise zero.
+ * Byte 7: flags (SPEC_FLAG_xxx).
  *
  * If any of the operands are not used, the spec byte should be set to 0.
  */
@@ -223,6 +255,15 @@ enum x86_opr_spec
 /* Merges two encoding specifications. */
 #define SPEC_MERGE(spec1,spec2) ((spec1)|(spec2))
 
+/* Get the opcode extension row of an encoding specification. */
+#define SPEC_EXT_ROW(spec) ((uint8_t)(((spec)>>48)&0xff))
+
+/* Test a flag in an encoding specification. */
+#define SPEC_FLAG(spec,flag) ((spec) & ((uint64_t)(flag)<<56))
+
+/* The instruction is only valid if the ModR/M byte is exactly F8. */
+#define SPEC_FLAG_MODRM_F8 0x01
+
 #define OP4(insn, oper1, oper2, oper3, oper4) SPEC_MAKE(I_##insn, O_##oper1, O_##oper2, O_##oper3, O_##oper4)
 #define OP3(insn, oper1, oper2, oper3) OP4(insn, oper1, oper2, oper3, NONE)
 #define OP2(insn, oper1, oper2) OP3(insn, oper1, oper2, NONE)
@@ -232,6 +273,12 @@ enum x86_opr_spec
 #define OP_EMPTY_4 OP_EMPTY, OP_EMPTY, OP_EMPTY, OP_EMPTY
 #define OP_EMPTY_8 OP_EMPTY_4, OP_EMPTY_4
 
+/* Build an opcode extension spec that refers to a row in x86_opcode_ext_map. */
+#define OPX(grp, row) (OP0(grp) | ((uint64_t)(X_##row)<<48))
+
+/* Attach a flag to an encoding specification. */
+#define OPF(spec, flag) ((spec) | ((uint64_t)(SPEC_FLAG_##flag)<<56))
+
 enum _extended_opcode_pseudo_insn
 {
     I__EXT1 = -1,
@@ -246,6 +293,23 @@ enum _extended_opcode_pseudo_insn
     I__EXT11 = -10
 };
 
+/* Rows in the opcode extension table. Each extended opcode has its own row,
+ * indexed by the REG field of the ModR/M byte, so that the operands of the
+ * opcode can be merged into the row at compile time.
+ */
+enum _extended_opcode_row
+{
+    X_80, X_81, X_82, X_83,         /* Group 1 */
+    X_8F,                           /* Group 1A */
+    X_C0, X_C1, X_D0, X_D1, X_D2, X_D3, /* Group 2 */
+    X_F6, X_F7,                     /* Group 3 */
+    X_FE,                           /* Group 4 */
+    X_FF,                           /* Group 5 */
+    X_0F00,                         /* Group 6 */
+    X_C6, X_C7,                     /* Group 11 */
+    X_COUNT
+};
+
 /*
  * Instruction encoding specification for one-byte opcodes. 
  * See Table A-2 in Intel Reference, Volume 2, Appendix A.
@@ -391,10 +455,10 @@ static const x86_insn_spec_t x86_opcode_map_1byte[256] =
     /* 7E */ OP1(JLE, Jb),
     /* 7F */ OP1(JNLE, Jb),
 
-    /* 80 */ OP2(_EXT1, Eb, Ib),
-    /* 81 */ OP2(_EXT1, Ev, Iz),
-    /* 82 */ OP2(_EXT1, Eb, Ib), /* i64 ??? TBD */
-    /* 83 */ OP2(_EXT1, Ev, Ib),
+    /* 80 */ OPX(_EXT1, 80),  /* Eb, Ib */
+    /* 81 */ OPX(_EXT1, 81),  /* Ev, Iz */
+    /* 82 */ OPX(_EXT1, 82),  /* Eb, Ib; i64 ??? TBD */
+    /* 83 */ OPX(_EXT1, 83),  /* Ev, Ib */
     /* 84 */ OP2(TEST, Eb, Gb),
     /* 85 */ OP2(TEST, Ev, Gv),
     /* 86 */ OP2(XCHG, Eb, Gb),
@@ -406,7 +470,7 @@ static const x86_insn_spec_t x86_opcode_map_1byte[256] =
     /* 8C */ OP2(MOV, Ev, Sw),
     /* 8D */ OP2(LEA, Gv, Mp), /* ??? missing TBD */
     /* 8E */ OP2(MOV, Sw, Ew),
-    /* 8F */ OP0(_EXT1A), /* POP(d74) Ev */
+    /* 8F */ OPX(_EXT1A, 8F), /* POP(d74) Ev */
 
     /* 90 */ OP0(NOP), /* PAUSE (F3), XCHG r8, rAX */
     /* 91 */ OP2(XCHG, rCX, rAX),
@@ -459,14 +523,14 @@ static const x86_insn_spec_t x86_opcode_map_1byte[256] =
     /* BE */ OP2(MOV, rSI, Iv),
     /* BF */ OP2(MOV, rDI, Iv),
 
-    /* C0 */ OP2(_EXT2, Eb, Ib),
-    /* C1 */ OP2(_EXT2, Ev, Ib),
+    /* C0 */ OPX(_EXT2, C0), /* Eb, Ib */
+    /* C1 */ OPX(_EXT2, C1), /* Ev, Ib */
     /* C2 */ OP1(RETN, Iw), /* f64 */
     /* C3 */ OP0(RETN),     /* f64 */
     /* C4 */ OP2(LES, Gz, Mp), /* i64; VEX+2byte */
     /* C5 */ OP2(LDS, Gz, Mp), /* i64; VEX+1byte */
-    /* C6 */ OP2(_EXT11, Eb, Ib),
-    /* C7 */ OP2(_EXT11, Ev, Iz),
+    /* C6 */ OPX(_EXT11, C6), /* Eb, Ib */
+    /* C7 */ OPX(_EXT11, C7), /* Ev, Iz */
     /* C8 */ OP2(ENTER, Iw, Ib),
     /* C9 */ OP0(LEAVE), /* d64 */
     /* CA */ OP1(RETF, Iw),
@@ -476,10 +540,10 @@ static const x86_insn_spec_t x86_opcode_map_1byte[256] =
     /* CE */ OP0(INTO), /* i64 */
     /* CF */ OP0(IRET), /* IRET/D/Q */
 
-    /* D0 */ OP2(_EXT2, Eb, 1),
-    /* D1 */ OP2(_EXT2, Ev, 1),
-    /* D2 */ OP2(_EXT2, Eb, CL),
-    /* D3 */ OP2(_EXT2, Ev, CL),
+    /* D0 */ OPX(_EXT2, D0), /* Eb, 1 */
+    /* D1 */ OPX(_EXT2, D1), /* Ev, 1 */
+    /* D2 */ OPX(_EXT2, D2), /* Eb, CL */
+    /* D3 */ OPX(_EXT2, D3), /* Ev, CL */
     /* D4 */ OP1(AAM, Ib), /* i64 */
     /* D5 */ OP1(AAD, Ib), /* i64 */
     /* D6 */ OP_EMPTY,
@@ -509,225 +573,152 @@ static const x86_insn_spec_t x86_opcode_map_1byte[256] =
     /* F3 */ OP_EMPTY, /* REPE (prefix) */
     /* F4 */ OP0(HLT),
     /* F5 */ OP0(CMC),
-    /* F6 */ OP1(_EXT3, Eb),
-    /* F7 */ OP1(_EXT3, Ev),
+    /* F6 */ OPX(_EXT3, F6), /* Eb */
+    /* F7 */ OPX(_EXT3, F7), /* Ev */
     /* F8 */ OP0(CLC),
     /* F9 */ OP0(STC),
     /* FA */ OP0(CLI),
     /* FB */ OP0(STI),
     /* FC */ OP0(CLD),
     /* FD */ OP0(STD),
-    /* FE */ OP0(_EXT4), /* INC/DEC */
-    /* FF */ OP0(_EXT5)  /* INC/DEC */
+    /* FE */ OPX(_EXT4, FE), /* INC/DEC */
+    /* FF */ OPX(_EXT5, FF)  /* INC/DEC */
 };
 
-/**
- * Decodes instruction prefixes. This function does not check the validity
- * of prefix specifications.
+/*
+ * Instruction encoding specification for opcode extensions, indexed by the
+ * row given in the one-byte spec and then by REG(modrm). The operands of the
+ * opcode are already merged into each entry.
+ * See Table A-6 in Intel Reference, Volume 2, Appendix A.
  */
-static x86_insn_prefix_t
-decode_prefix(x86_insn_reader_t *rd, const x86_options_t *opt)
+#define EXT1_ROW(oper1, oper2) \
+    { OP2(ADD, oper1, oper2), OP2(OR,  oper1, oper2), \
+      OP2(ADC, oper1, oper2), OP2(SBB, oper1, oper2), \
+      OP2(AND, oper1, oper2), OP2(SUB, oper1, oper2), \
+      OP2(XOR, oper1, oper2), OP2(CMP, oper1, oper2) }
+
+#define EXT2_ROW(oper1, oper2) \
+    { OP2(ROL, oper1, oper2), OP2(ROR, oper1, oper2), \
+      OP2(RCL, oper1, oper2), OP2(RCR, oper1, oper2), \
+      OP2(SHL, oper1, oper2), OP2(SHR, oper1, oper2), \
+      OP_EMPTY,               OP2(SAR, oper1, oper2) }
+
+static const x86_insn_spec_t x86_opcode_ext_map[X_COUNT][8] =
 {
-    /* Decode each byte until the byte is not a prefix or is an REX prefix,
-     * because an REX prefix is required to immediately preceed the opcode.
-     */
-    x86_insn_prefix_t pfx = 0;
-    for ( ; ; )
-    {
-        unsigned char c = peek_byte(rd);
-        x86_insn_prefix_t t = 0;
-
-        /* Check for REX prefix if we're in 64-bit mode. */
-        if (CPU_SIZE(opt) == OPR_64BIT && (c & 0xf0) == 0x40)
-        {
-            read_byte(rd);
-            break;
-        }
-
-        /* Check for legacy prefixes. */
-        switch (c)
-        {
-        case 0xF0: t = PFX_LOCK; break;
-        case 0xF2: t = PFX_REPNE; break;
-        case 0xF3: t = PFX_REPE; break;
-        case 0x2E: t = PFX_CS; break;
-        case 0x36: t = PFX_SS; break;
-        case 0x3E: t = PFX_DS; break;
-        case 0x26: t = PFX_ES; break;
-        case 0x64: t = PFX_FS; break;
-        case 0x65: t = PFX_GS; break;
-        case 0x66: t = PFX_OPERAND_SIZE; break;
-        case 0x67: t = PFX_ADDRESS_SIZE; break;
-        }
-        if (t == 0)
-            break;
-
-        /* Consume 1 byte. */
-        read_byte(rd);
-        pfx |= t;
+    /* 80 */ EXT1_ROW(Eb, Ib),
+    /* 81 */ EXT1_ROW(Ev, Iz),
+    /* 82 */ EXT1_ROW(Eb, Ib),
+    /* 83 */ EXT1_ROW(Ev, Ib),
+
+    /* 8F */ { OP1(POP, Ev), OP_EMPTY, OP_EMPTY, OP_EMPTY, OP_EMPTY_4 },
+
+    /* C0 */ EXT2_ROW(Eb, Ib),
+    /* C1 */ EXT2_ROW(Ev, Ib),
+    /* D0 */ EXT2_ROW(Eb, 1),
+    /* D1 */ EXT2_ROW(Ev, 1),
+    /* D2 */ EXT2_ROW(Eb, CL),
+    /* D3 */ EXT2_ROW(Ev, CL),
+
+    /* F6 */ {
+        OP2(TEST, Eb, Ib),
+        OP_EMPTY,
+        OP1(NOT,  Eb),
+        OP1(NEG,  Eb),
+        OP2(MUL,  Eb, AL),
+        OP2(IMUL, Eb, AL),
+        OP2(DIV,  Eb, AL),
+        OP2(IDIV, Eb, AL)
+    },
+    /* F7 */ {
+        OP2(TEST, Ev, Iz),
+        OP_EMPTY,
+        OP1(NOT,  Ev),
+        OP1(NEG,  Ev),
+        OP2(MUL,  Ev, rAX),
+        OP2(IMUL, Ev, rAX),
+        OP2(DIV,  Ev, rAX),
+        OP2(IDIV, Ev, rAX)
+    },
+
+    /* FE */ { OP1(INC, Eb), OP1(DEC, Eb), OP_EMPTY, OP_EMPTY, OP_EMPTY_4 },
+
+    /* FF */ {
+        OP1(INC,  Ev), OP1(DEC,  Ev), OP1(CALLN, Ev), OP1(CALLF, Ep),
+        OP1(JMPN, Ev), OP1(JMPF, Mp), OP1(PUSH,  Ev), OP_EMPTY
+    },
+
+    /* 0F 00 */ {
+        OP2(SLDT, Rv, Mw),
+        OP2(STR, Rv, Mw),
+        OP1(LLDT, Ew),
+        OP1(LTR, Ew),
+        OP1(VERR, Ew),
+        OP1(VERW, Ew),
+        OP_EMPTY,
+        OP_EMPTY
+    },
+
+    /* C6 */ {
+        OP2(MOV, Eb, Ib), OP_EMPTY, OP_EMPTY, OP_EMPTY,
+        OP_EMPTY, OP_EMPTY, OP_EMPTY, OPF(OP1(XABORT, Ib), MODRM_F8)
+    },
+    /* C7 */ {
+        OP2(MOV, Ev, Iz), OP_EMPTY, OP_EMPTY, OP_EMPTY,
+        OP_EMPTY, OP_EMPTY, OP_EMPTY, OPF(OP1(XBEGIN, Jz), MODRM_F8)
     }
+};
 
-    /* If any prefix was read, update the opcode pointer. */
-    if (pfx)
-        mark_opcode(rd);
-
-    return pfx;
-}
-
-static x86_insn_spec_t
-process_opcode_extension(
-    x86_insn_spec_t spec,
-    uint32_t opcode, 
-    unsigned char modrm)
+/*
+ * Maps each byte to the instruction prefix it represents, or 0 if the byte
+ * is not a legacy prefix.
+ */
+static const x86_insn_prefix_t x86_prefix_map[256] =
 {
-    int16_t op = SPEC_INSN(spec);
-    int reg = REG(modrm);
-    int mod = MOD(modrm);
-
-    /* Remove the opcode part of 'spec' so that it can be merged. */
-    spec = SPEC_OPERANDS(spec);
-
-    if (op == I__EXT1)
-    {
-        static const x86_insn_spec_t map[8] =
-        {
-            OP0(ADD), OP0(OR),  OP0(ADC), OP0(SBB),
-            OP0(AND), OP0(SUB), OP0(XOR), OP0(CMP)
-        };
-        return SPEC_MERGE(map[reg], spec);
-    }
-
-    if (op == I__EXT1A)
-    {
-        static const x86_insn_spec_t map[8] = { OP1(POP, Ev) };
-        return SPEC_MERGE(map[reg], spec);
-    }
-
-    if (op == I__EXT2)
-    {
-        static const x86_insn_spec_t map[8] =
-        {
-            OP0(ROL), OP0(ROR), OP0(RCL), OP0(RCR),
-            OP0(SHL), OP0(SHR), OP_EMPTY, OP0(SAR)
-        };
-        return SPEC_MERGE(map[reg], spec);
-    }
-
-    if (op == I__EXT3)
-    {
-        static const x86_insn_spec_t map_f6[8] =
-        {
-            OP2(TEST, Eb, Ib),
-            OP_EMPTY,
-            OP1(NOT,  Eb),
-            OP1(NEG,  Eb),
-            OP2(MUL,  Eb, AL),
-            OP2(IMUL, Eb, AL),
-            OP2(DIV,  Eb, AL),
-            OP2(IDIV, Eb, AL)
-        };
-        static const x86_insn_spec_t map_f7[8] =
-        {
-            OP2(TEST, Ev, Iz),
-            OP_EMPTY,
-            OP1(NOT,  Ev),
-            OP1(NEG,  Ev),
-            OP2(MUL,  Ev, rAX),
-            OP2(IMUL, Ev, rAX),
-            OP2(DIV,  Ev, rAX),
-            OP2(IDIV, Ev, rAX)
-        };
-        if (opcode == 0xF6)
-            return map_f6[reg];
-        else /* opcode == 0xF7 */
-            return map_f7[reg];
-    }
-
-    if (op == I__EXT4)
-    {
-        static const x86_insn_spec_t map[8] = 
-        {
-            OP1(INC, Eb), OP1(DEC, Eb)
-        };
-        return map[reg];
-    }
-
-    if (op == I__EXT5)
-    {
-        static const x86_insn_spec_t map[8] = 
-        {
-            OP1(INC,  Ev), OP1(DEC,  Ev), OP1(CALLN, Ev), OP1(CALLF, Ep),
-            OP1(JMPN, Ev), OP1(JMPF, Mp), OP1(PUSH,  Ev), OP_EMPTY
-        };
-        return map[reg];
-    }
-
-    if (op == I__EXT6)
-    {
-        static const x86_insn_spec_t map[8] = 
-        {
-            OP2(SLDT, Rv, Mw),
-            OP2(STR, Rv, Mw),
-            OP1(LLDT, Ew),
-            OP1(LTR, Ew),
-            OP1(VERR, Ew),
-            OP1(VERW, Ew),
-            OP_EMPTY,
-            OP_EMPTY
-        };
-        return map[reg];
-    }
-
-    if (op == I__EXT11)
-    {
-        if (reg == 0)
-        {
-            if (opcode == 0xC6)
-                return OP2(MOV, Eb, Ib);
-            else if (opcode == 0xC7)
-                return OP2(MOV, Ev, Iz);
-        }
-        else if (modrm == 0xF8)
-        {
-            if (opcode == 0xC6)
-                return OP1(XABORT, Ib);
-            else if (opcode == 0xC7)
-                return OP1(XBEGIN, Jz);
-        }
-        return 0;
-    }
-
-    /* Invalid opcode extension. */
-    return 0;
-}
+    /* 00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 20 */ 0, 0, 0, 0, 0, 0, PFX_ES, 0, 0, 0, 0, 0, 0, 0, PFX_CS, 0,
+    /* 30 */ 0, 0, 0, 0, 0, 0, PFX_SS, 0, 0, 0, 0, 0, 0, 0, PFX_DS, 0,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ 0, 0, 0, 0, PFX_FS, PFX_GS, PFX_OPERAND_SIZE, PFX_ADDRESS_SIZE,
+             0, 0, 0, 0, 0, 0, 0, 0,
+    /* 70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 80 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* A0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* B0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* C0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* E0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* F0 */ PFX_LOCK, 0, PFX_REPNE, PFX_REPE, 0, 0, 0, 0,
+             0, 0, 0, 0, 0, 0, 0, 0
+};
 
 /* Decodes the opcode of an instruction and returns its encoding 
  * specification.
  */
-static x86_insn_spec_t
-decode_opcode(
-    x86_insn_reader_t *rd,
-    int cpu_size)        
+static x86_insn_spec_t decode_opcode(x86_insn_reader_t *rd)
 {
-    unsigned char c;
+    unsigned char c, modrm;
     x86_insn_spec_t spec;
 
     /* Process the first byte of the opcode. */
     c = read_byte(rd);
     mark_modrm(rd);
     spec = x86_opcode_map_1byte[c];
+    STAT_HIT(opcode[c]);
     
-    /* Return the encoding spec if it is a valid instruction. */
-    if (SPEC_INSN(spec) > 0)
+    /* Return the encoding spec unless it requires an opcode extension. */
+    if (SPEC_INSN(spec) >= 0)
         return spec;
 
-    /* Process opcode extension if required. */
-    if (SPEC_INSN(spec) < 0)
-    {
-        return process_opcode_extension(spec, c, read_modrm(rd));
-    }
-
-    return 0;
+    /* Look up the opcode extension by REG(modrm). */
+    STAT_HIT(ext[-SPEC_INSN(spec) - 1]);
+    modrm = read_modrm(rd);
+    spec = x86_opcode_ext_map[SPEC_EXT_ROW(spec)][REG(modrm)];
+    if (SPEC_FLAG(spec, SPEC_FLAG_MODRM_F8) && modrm != 0xF8)
+        return 0;
+    return spec;
 }
 
 #define FILL_REG(_opr, _reg) \
@@ -785,373 +776,582 @@ struct x86_raw_insn_t
 };
 #endif
 
-/* Decodes a memory (or optionally register) operand. A ModR/M byte follows
- * the opcode and specifies the operand. If reg_type is not zero, the operand
- * is allowed to be a register of the specified type. If the operand is a 
- * memory address, the address is computed from a segment register and any of
- * the following values: a base register, an index register, a scaling factor, 
- * and a displacement.
- *
- * The function returns non-zero if successful, or 0 if the instruction is
- * invalid.
+/*
+ * Enumerated values for the addressing method of an operand, which tells
+ * decode_operand() where to find the operand.
+ */
+enum x86_opr_method
+{
+    M_INVALID = 0,  /* operand spec not supported */
+    M_REG,          /* register fixed by the opcode */
+    M_CONST,        /* immediate fixed by the opcode */
+    M_MODRM_RM,     /* register or memory given by ModR/M (Eb, Ev, Mp, ...) */
+    M_MODRM_REG,    /* register given by REG(modrm) (Gb, Gv, Sw, ...) */
+    M_IMM,          /* immediate */
+    M_REL,          /* immediate encodes offset relative to next insn */
+    M_MOFFS,        /* absolute memory address in displacement */
+    M_STRING,       /* memory addressed by DS:rSI or ES:rDI */
+    M_PTR           /* far pointer seg:off encoded in immediate */
+};
+
+/*
+ * Operand size classes that depend on the cpu word size. Values below
+ * OSZ_V are fixed sizes of enum x86_opr_size.
+ */
+#define OSZ_V   0x10    /* native word size */
+#define OSZ_Z   0x11    /* word for 16-bit, dword for 32- or 64-bit */
+#define OSZ_P   0x12    /* far pointer; only supported for 16-bit */
+
+/* Describes how to decode an operand spec. */
+typedef struct x86_opr_desc_t
+{
+    uint8_t   method;   /* enum x86_opr_method */
+    uint8_t   size;     /* operand size or size class (OSZ_xxx) */
+    uint8_t   aux;      /* register type (ModR/M), or base register (string) */
+    uint8_t   reserved;
+    x86_reg_t arg;      /* register (without size), segment, or constant */
+} x86_opr_desc_t;
+
+#define D(method, size, aux, arg) { M_##method, size, aux, 0, arg }
+#define D_INVALID       D(INVALID, 0, 0, 0)
+#define D_INVALID_2     D_INVALID, D_INVALID
+#define D_INVALID_16    D_INVALID_2, D_INVALID_2, D_INVALID_2, D_INVALID_2, \
+                        D_INVALID_2, D_INVALID_2, D_INVALID_2, D_INVALID_2
+
+/* Fixed register with the given type, number, size, and offset. */
+#define D_REG(type, number, size, offset) \
+    D(REG, size, 0, REG_MAKE(type, number, 0, offset))
+
+/* 16 consecutive fixed registers numbered 0-15. */
+#define D_REG_16(type, size) \
+    D_REG(type, 0, size, 0),  D_REG(type, 1, size, 0), \
+    D_REG(type, 2, size, 0),  D_REG(type, 3, size, 0), \
+    D_REG(type, 4, size, 0),  D_REG(type, 5, size, 0), \
+    D_REG(type, 6, size, 0),  D_REG(type, 7, size, 0), \
+    D_REG(type, 8, size, 0),  D_REG(type, 9, size, 0), \
+    D_REG(type, 10, size, 0), D_REG(type, 11, size, 0), \
+    D_REG(type, 12, size, 0), D_REG(type, 13, size, 0), \
+    D_REG(type, 14, size, 0), D_REG(type, 15, size, 0)
+
+/* Low byte registers 0-3 followed by high byte registers 0-11. */
+#define D_REG_BYTE_16 \
+    D_REG(R_TYPE_GENERAL, 0, OPR_8BIT, 0), D_REG(R_TYPE_GENERAL, 1, OPR_8BIT, 0), \
+    D_REG(R_TYPE_GENERAL, 2, OPR_8BIT, 0), D_REG(R_TYPE_GENERAL, 3, OPR_8BIT, 0), \
+    D_REG(R_TYPE_GENERAL, 0, OPR_8BIT, 1), D_REG(R_TYPE_GENERAL, 1, OPR_8BIT, 1), \
+    D_REG(R_TYPE_GENERAL, 2, OPR_8BIT, 1), D_REG(R_TYPE_GENERAL, 3, OPR_8BIT, 1), \
+    D_REG(R_TYPE_GENERAL, 4, OPR_8BIT, 1), D_REG(R_TYPE_GENERAL, 5, OPR_8BIT, 1), \
+    D_REG(R_TYPE_GENERAL, 6, OPR_8BIT, 1), D_REG(R_TYPE_GENERAL, 7, OPR_8BIT, 1), \
+    D_REG(R_TYPE_GENERAL, 8, OPR_8BIT, 1), D_REG(R_TYPE_GENERAL, 9, OPR_8BIT, 1), \
+    D_REG(R_TYPE_GENERAL, 10, OPR_8BIT, 1), D_REG(R_TYPE_GENERAL, 11, OPR_8BIT, 1)
+
+/* 16 consecutive immediate constants 0-15. */
+#define D_CONST_16 \
+    D(CONST, OPR_8BIT, 0, 0),  D(CONST, OPR_8BIT, 0, 1), \
+    D(CONST, OPR_8BIT, 0, 2),  D(CONST, OPR_8BIT, 0, 3), \
+    D(CONST, OPR_8BIT, 0, 4),  D(CONST, OPR_8BIT, 0, 5), \
+    D(CONST, OPR_8BIT, 0, 6),  D(CONST, OPR_8BIT, 0, 7), \
+    D(CONST, OPR_8BIT, 0, 8),  D(CONST, OPR_8BIT, 0, 9), \
+    D(CONST, OPR_8BIT, 0, 10), D(CONST, OPR_8BIT, 0, 11), \
+    D(CONST, OPR_8BIT, 0, 12), D(CONST, OPR_8BIT, 0, 13), \
+    D(CONST, OPR_8BIT, 0, 14), D(CONST, OPR_8BIT, 0, 15)
+
+/*
+ * Decoding descriptor of each operand spec, indexed by enum x86_opr_spec.
+ */
+static const x86_opr_desc_t x86_opr_desc[256] =
+{
+    /* NONE */ D_INVALID,
+    /* Ap */ D(PTR, OSZ_P, 0, 0),
+    /* Eb */ D(MODRM_RM, OPR_8BIT, R_TYPE_GENERAL, 0),
+    /* Ep */ D(MODRM_RM, OSZ_P, R_TYPE_GENERAL, 0),
+    /* Ev */ D(MODRM_RM, OSZ_V, R_TYPE_GENERAL, 0),
+    /* Ew */ D(MODRM_RM, OPR_16BIT, R_TYPE_GENERAL, 0),
+    /* Fv */ D_INVALID,
+    /* Gb */ D(MODRM_REG, OPR_8BIT, R_TYPE_GENERAL, 0),
+    /* Gv */ D(MODRM_REG, OSZ_V, R_TYPE_GENERAL, 0),
+    /* Gw */ D(MODRM_REG, OPR_16BIT, R_TYPE_GENERAL, 0),
+    /* Gz */ D(MODRM_REG, OSZ_Z, R_TYPE_GENERAL, 0),
+    /* Ib */ D(IMM, OPR_8BIT, 0, 0),
+    /* Iv */ D(IMM, OSZ_V, 0, 0),
+    /* Iw */ D(IMM, OPR_16BIT, 0, 0),
+    /* Iz */ D(IMM, OSZ_Z, 0, 0),
+    /* Jb */ D(REL, OPR_8BIT, 0, 0),
+    /* Jz */ D(REL, OSZ_Z, 0, 0),
+    /* Ma */ D_INVALID,
+    /* Mp */ D(MODRM_RM, OSZ_P, 0, 0),
+    /* Mw */ D_INVALID,
+    /* Ob */ D(MOFFS, OPR_8BIT, 0, R_DS),
+    /* Ov */ D(MOFFS, OSZ_V, 0, R_DS),
+    /* Rv */ D_INVALID,
+    /* Sw */ D(MODRM_REG, OPR_16BIT, R_TYPE_SEGMENT, 0),
+    /* Xb */ D(STRING, OPR_8BIT, 6, R_DS),
+    /* Xv */ D(STRING, OSZ_V, 6, R_DS),
+    /* Xz */ D_INVALID,
+    /* Yb */ D(STRING, OPR_8BIT, 7, R_ES),
+    /* Yv */ D(STRING, OSZ_V, 7, R_ES),
+    /* Yz */ D_INVALID,
+    /* 1E-1F */ D_INVALID_2,
+    /* 20-7F */ D_INVALID_16, D_INVALID_16, D_INVALID_16,
+                D_INVALID_16, D_INVALID_16, D_INVALID_16,
+    /* 80-8F: immediate */ D_CONST_16,
+    /* 90-9F: XS */ D_REG_16(R_TYPE_SEGMENT, OPR_16BIT),
+    /* A0-AF: XL, XH */ D_REG_BYTE_16,
+    /* B0-BF: XX */ D_REG_16(R_TYPE_GENERAL, OPR_16BIT),
+    /* C0-CF: eXX */ D_REG_16(R_TYPE_GENERAL, OSZ_Z),
+    /* D0-DF: rXX */ D_REG_16(R_TYPE_GENERAL, OSZ_V),
+    /* E0-FF */ D_INVALID_16, D_INVALID_16
+};
+
+/* Resolves an operand size class (OSZ_xxx) for the given cpu word size. 
+ * Returns -1 if the operand is not supported in that mode.
+ */
+static int resolve_opr_size(int size, int cpu_size)
+{
+    if (size < OSZ_V)
+        return size;
+    if (size == OSZ_V)
+        return cpu_size;
+    if (size == OSZ_Z)
+        return (cpu_size == OPR_16BIT)? OPR_16BIT : OPR_32BIT;
+    return (cpu_size == OPR_16BIT)? OPR_32BIT : -1; /* OSZ_P */
+}
+
+/* Returns the number of bytes taken by an immediate of the given size. */
+static int imm_bytes(int size)
+{
+    return (size == OPR_8BIT)? 1 :
+        (size == OPR_16BIT)? 2 :
+        (size == OPR_32BIT)? 4 : 0;
+}
+
+/*
+ * Maps the segment override bits of an instruction prefix, shifted right
+ * by 3, to the segment register they select. If there is no override (or
+ * more than one), the entry is 0 to use the default segment.
+ */
+static const x86_reg_t x86_segment_override[64] =
+{
+    0, R_ES, R_CS, 0, R_SS, 0, 0, 0, R_DS, 0, 0, 0, 0, 0, 0, 0,
+    R_FS, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    R_GS, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* Base and index registers of the 16-bit memory addressing forms, indexed
+ * by RM(modrm): [BX+SI], [BX+DI], [BP+SI], [BP+DI], [SI], [DI], [BP], [BX].
+ * See Table 2-1 in Intel Reference, Volume 2, Chapter 2.
+ */
+static const x86_reg_t x86_modrm16_base[8] = 
+{
+    R_BX, R_BX, R_BP, R_BP, R_SI, R_DI, R_BP, R_BX
+};
+static const x86_reg_t x86_modrm16_index[8] = 
+{
+    R_SI, R_DI, R_SI, R_DI, R_NONE, R_NONE, R_NONE, R_NONE
+};
+
+/* Instantiate the decoder for each cpu word size. */
+#define DECODE_MODE OPR_16BIT
+#define DECODE_FN(name) name##_16
+#include "decode_mode.inc"
+#undef DECODE_FN
+#undef DECODE_MODE
+
+#define DECODE_MODE OPR_32BIT
+#define DECODE_FN(name) name##_32
+#include "decode_mode.inc"
+#undef DECODE_FN
+#undef DECODE_MODE
+
+#define DECODE_MODE OPR_64BIT
+#define DECODE_FN(name) name##_64
+#include "decode_mode.inc"
+#undef DECODE_FN
+#undef DECODE_MODE
+
+/* Signature of a mode-specialized instruction decoder. */
+typedef int (*decode_insn_fn)(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    x86_insn_t *insn,
+    int *nopr);
+
+/* Selects the decoder specialized for the cpu word size in the options.
+ * Returns NULL if the mode is not supported.
  */
-static int decode_memory_operand(
-    x86_opr_t *opr,         /* decoded operand */
-    x86_insn_reader_t *rd,  /* stream reader */
-    int opr_size,           /* size of the register or operand */
-    int reg_type,           /* if non-zero, type of the register */
-    int cpu_size,           /* word-size of the cpu */
-    x86_insn_prefix_t pfx)  /* instruction prefix */
+static decode_insn_fn select_decoder(const x86_options_t *opt)
 {
-    unsigned char modrm = read_modrm(rd);
-    x86_reg_t seg = 0; /* default segment */
+    switch (CPU_SIZE(opt))
+    {
+    case OPR_16BIT: return decode_insn_16;
+    case OPR_32BIT: return decode_insn_32;
+    case OPR_64BIT: return decode_insn_64;
+    default:        return NULL;
+    }
+}
 
-    if (cpu_size == OPR_16BIT)
+/* Decodes an instruction with the decoder specialized for the cpu word 
+ * size in the options. See decode_insn_16() for details.
+ */
+static int decode_insn(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    x86_insn_t *insn, 
+    const x86_options_t *opt,
+    int *nopr)
+{
+    switch (CPU_SIZE(opt))
     {
-        /* Decode a register if MOD = (11). */
-        if (MOD(modrm) == 3)
-        {
-            if (reg_type == 0) /* register not allowed */
-                return 0;
+    case OPR_16BIT: return decode_insn_16(code_begin, code_end, insn, nopr);
+    case OPR_32BIT: return decode_insn_32(code_begin, code_end, insn, nopr);
+    case OPR_64BIT: return decode_insn_64(code_begin, code_end, insn, nopr);
+    default:        *nopr = 0; STAT_HIT(decodes); return DECODE_FAIL(X86_FAIL_MODE);
+    }
+}
 
-            /* Interpret it as a register. Treat AH-DH specially. */
-            if (reg_type == R_TYPE_GENERAL && opr_size == OPR_8BIT)
-                FILL_REG(opr, REG_CONVERT_BYTE(RM(modrm)));
-            else
-                FILL_REG(opr, REG_MAKE(reg_type, RM(modrm), opr_size, 0));
-            return 1;
-        }
+/* An all-zero instruction used to clear the output of x86_decode(). */
+static const x86_insn_t x86_insn_empty;
+
+int x86_decode(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    x86_insn_t *insn, 
+    const x86_options_t *opt)
+{
+    int nopr;
+
+    /* Clear instruction. A structure assignment lets the compiler emit a
+     * few wide stores, which is much cheaper than a memset() that compiles
+     * to a string instruction. */
+    *insn = x86_insn_empty;
+
+    return decode_insn(code_begin, code_end, insn, opt, &nopr);
+}
 
-        /* Take into account segment override prefix if any. */
-        switch (pfx & PFX_GROUP2)
+size_t x86_decode_batch(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    const size_t offsets[],
+    size_t n,
+    x86_insn_batch_t *out,
+    const x86_options_t *opt)
+{
+    decode_insn_fn decode = select_decoder(opt);
+    size_t size = code_end - code_begin;
+    size_t decoded = 0;
+    size_t k;
+
+    for (k = 0; k < n; k++)
+    {
+        x86_insn_t insn;
+        int count = -1, nopr = 0, i;
+
+        /* The instruction is decoded into a scratch structure which is never
+         * cleared; only the operands actually decoded are packed. The
+         * decoder reads at most X86_MAX_INSN_LENGTH bytes, so that every
+         * length fits the length column. */
+        if (decode && offsets[k] < size)
         {
-        case 0: break;
-        case PFX_ES: seg = R_ES; break;
-        case PFX_CS: seg = R_CS; break;
-        case PFX_SS: seg = R_SS; break;
-        case PFX_DS: seg = R_DS; break;
-        case PFX_FS: seg = R_FS; break;
-        case PFX_GS: seg = R_GS; break;
+            const unsigned char *code = code_begin + offsets[k];
+            const unsigned char *end = code_end;
+            if (end - code > X86_MAX_INSN_LENGTH)
+                end = code + X86_MAX_INSN_LENGTH;
+            count = decode(code, end, &insn, &nopr);
         }
-
-        /* Decode a direct memory address if MOD = (00) and RM = (110). */
-        if (MOD(modrm) == 0 && RM(modrm) == 6) /* disp16, zero-extended */
+        else
         {
-            uint16_t disp = read_word(rd);
-            FILL_MEM(opr, opr_size, seg, 0, 0, 0, disp);
-            return 1;
+            STAT_HIT(decodes);
+            STAT_HIT(failure[decode? X86_FAIL_TRUNCATED : X86_FAIL_MODE]);
+        }
+        if (count <= 0)
+        {
+            count = 0;
+            nopr = 0;
+            insn.pfx = 0;
+            insn.op = I_NONE;
+        }
+        else
+        {
+            decoded++;
         }
 
-        /* Decode an indirect memory address XX[+YY][+disp]. */
-        /* We use the default segment register here. */
-        switch (RM(modrm))
+        out->length[k] = (uint8_t)count;
+        if (out->mnemonic)
+            out->mnemonic[k] = (uint16_t)insn.op;
+        if (out->prefix)
+            out->prefix[k] = insn.pfx;
+        if (out->opr_kind && out->opr_data)
         {
-        case 0: /* [BX+SI] */
-            FILL_MEM(opr, opr_size, seg, R_BX, R_SI, 1, 0);
-            break;
-        case 1: /* [BX+DI] */
-            FILL_MEM(opr, opr_size, seg, R_BX, R_DI, 1, 0);
-            break;
-        case 2: /* [BP+SI] */
-            FILL_MEM(opr, opr_size, seg, R_BP, R_SI, 1, 0);
-            break;
-        case 3: /* [BP+DI] */
-            FILL_MEM(opr, opr_size, seg, R_BP, R_SI, 1, 0);
-            break;
-        case 4: /* [SI] */
-            FILL_MEM(opr, opr_size, seg, R_SI, 0, 1, 0);
-            break;
-        case 5: /* [DI] */
-            FILL_MEM(opr, opr_size, seg, R_DI, 0, 1, 0);
-            break;
-        case 6: /* [BP] */
-            FILL_MEM(opr, opr_size, seg, R_BP, 0, 1, 0);
-            break;
-        case 7: /* [BX] */
-            FILL_MEM(opr, opr_size, seg, R_BX, 0, 1, 0);
-            break;
+            uint8_t *kind = &out->opr_kind[k * MAX_OPERANDS];
+            uint64_t *data = &out->opr_data[k * MAX_OPERANDS];
+            for (i = 0; i < nopr; i++)
+                kind[i] = x86_pack_operand(&insn.oprs[i], &data[i]);
+            for ( ; i < MAX_OPERANDS; i++)
+            {
+                kind[i] = 0;
+                data[i] = 0;
+            }
         }
-        if (MOD(modrm) == 1) /* disp8, sign-extended */
-            opr->val.mem.displacement = (int8_t)read_byte(rd);
-        else if (MOD(modrm) == 2) /* disp16, sign-extended */
-            opr->val.mem.displacement = (int16_t)read_word(rd);
-        return 1;
     }
-    else if (cpu_size == OPR_32BIT)
-    {
+    return decoded;
+}
 
+int x86_decode_packed(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    x86_insn_packed_t *packed,
+    const x86_options_t *opt)
+{
+    x86_insn_t insn;
+    int count, nopr, i;
+
+    /* Decode into a scratch instruction which is never cleared; the unused
+     * operands are marked as such before packing. */
+    count = decode_insn(code_begin, code_end, &insn, opt, &nopr);
+    if (count <= 0)
+        return -1;
+    for (i = nopr; i < MAX_OPERANDS; i++)
+        insn.oprs[i].type = OPR_NONE;
+    if (!x86_insn_pack(&insn, packed))
+        return -1;
+    return count;
+}
+
+int x86_insn_length(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    const x86_options_t *opt,
+    int *flow)
+{
+    switch (CPU_SIZE(opt))
+    {
+    case OPR_16BIT: return insn_length_16(code_begin, code_end, flow);
+    case OPR_32BIT: return insn_length_32(code_begin, code_end, flow);
+    case OPR_64BIT: return insn_length_64(code_begin, code_end, flow);
+    default:        STAT_HIT(decodes); return DECODE_FAIL(X86_FAIL_MODE);
     }
-    return 0; /* should not reach here */
 }
 
-/* Decode an operand from an instruction. If successful, returns non-zero.
- * If failed, returns zero.
+/*
+ * Length and flow class of every unprefixed one-byte opcode in 16-bit mode,
+ * indexed by the opcode byte followed by the next byte (the ModR/M byte if
+ * the opcode takes one). Bits 0-3 hold the length of the instruction, or 0
+ * if it is invalid; bits 4-6 hold its flow class. The length of a prefixed
+ * or two-byte instruction depends on more bytes, so the entries for prefixes
+ * and the 0F escape are LENGTH_SLOW instead. The table is derived from the
+ * opcode map by x86_length_table_init().
  */
-static int decode_operand(
-    x86_opr_t *opr,             /* decoded operand */
-    x86_insn_reader_t *rd,      /* stream reader */
-    int spec,                   /* operand encoding specification */
-    x86_insn_prefix_t pfx,      /* instruction prefix */
-    const x86_options_t *opt)   /* options */
+#define LENGTH_SLOW 0x80
+static unsigned char x86_length_table[256 * 256];
+static int x86_length_table_ready = 0;
+
+void x86_length_table_init(void)
 {
-    int reg = R_NONE;
-    unsigned char modrm;
-    /* uint32_t imm; */
-    int cpu_size = CPU_SIZE(opt);
-    /* int opr_size; */
-
-    /* Decode specific registers. */
-    if (spec >= 0x90)
+    unsigned char buf[X86_MAX_INSN_LENGTH] = { 0 };
+    int op, modrm, len, flow;
+#ifdef X86_DECODE_STATS
+    x86_decode_stats_t saved = x86_stats; /* building is not decoding */
+#endif
+
+    if (x86_length_table_ready)
+        return;
+
+    for (op = 0; op < 256; op++)
     {
-        int reg;
-        int number = spec & 0xf;
-        switch (spec & 0xf0)
+        for (modrm = 0; modrm < 256; modrm++)
         {
-        case O_XS: /* segment register */
-            reg = REG_MAKE(R_TYPE_SEGMENT, number, OPR_16BIT, 0);
-            break;
-        case O_XL: /* low byte register */
-            if (number < 4)
-                reg = REG_MAKE(R_TYPE_GENERAL, number, OPR_8BIT, 0);
+            unsigned char e;
+            if (op == 0x0F || x86_prefix_map[op] != 0)
+            {
+                e = LENGTH_SLOW;
+            }
             else
-                reg = REG_MAKE(R_TYPE_GENERAL, number - 4, OPR_8BIT, R_OFFSET_HIBYTE);
-            break;
-#if 0
-        case O_XH: /* high byte register */    
-            break;
-#endif
-        case O_XX: /* 16-bit GPR */
-            reg = REG_MAKE(R_TYPE_GENERAL, number, OPR_16BIT, 0);
-            break;
-        case O_eXX: /* 16-bit or 32-bit */
-            reg = REG_MAKE(R_TYPE_GENERAL, number, 
-                (cpu_size == OPR_16BIT)? OPR_16BIT : OPR_32BIT, 0);
-            break;
-        case O_rXX: /* 16-bit, 32-bit, or 64-bit */
-            reg = REG_MAKE(R_TYPE_GENERAL, number, cpu_size, 0);
-            break;
-        default:
-            return 0;
+            {
+                buf[0] = (unsigned char)op;
+                buf[1] = (unsigned char)modrm;
+                len = insn_length_16(buf, buf + sizeof(buf), &flow);
+                e = (len < 0)? 0 : (unsigned char)(len | (flow << 4));
+            }
+            x86_length_table[op * 256 + modrm] = e;
         }
-        FILL_REG(opr, reg);
-        return 1;
     }
+    x86_length_table_ready = 1;
+#ifdef X86_DECODE_STATS
+    x86_stats = saved;
+#endif
+}
+
+/* Computes the length of the instruction at _code_ by the full decoder, but
+ * reads at most X86_MAX_INSN_LENGTH bytes.
+ */
+static int superset_length_slow(
+    const unsigned char *code,
+    const unsigned char *code_end,
+    const x86_options_t *opt,
+    int *flow)
+{
+    if (code_end - code > X86_MAX_INSN_LENGTH)
+        code_end = code + X86_MAX_INSN_LENGTH;
+    *flow = X86_FLOW_NONE;
+    return x86_insn_length(code, code_end, opt, flow);
+}
+
+void x86_superset_length(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    const x86_options_t *opt,
+    signed char *lengths,
+    unsigned char *flows)
+{
+    size_t n = code_end - code_begin;
+    size_t i;
+    int len, flow;
 
-    /* Decode immediates. */
-    if (spec >= 0x80)
+    /* Only 16-bit mode has a lookup table; other modes, and 16-bit mode
+     * before x86_length_table_init() is called, use the decoder.
+     */
+    if (CPU_SIZE(opt) != OPR_16BIT || !x86_length_table_ready)
     {
-        opr->size = OPR_8BIT;
-        opr->type = OPR_IMM;
-        opr->val.imm = (spec - O_n);
-        return 1;
+        for (i = 0; i < n; i++)
+        {
+            len = superset_length_slow(code_begin + i, code_end, opt, &flow);
+            lengths[i] = (signed char)((len < 0)? -1 : len);
+            if (flows)
+                flows[i] = (unsigned char)((len < 0)? X86_FLOW_NONE : flow);
+        }
+        return;
     }
 
-    /* Decode regular operands. */
-    switch (spec)
+    for (i = 0; i < n; i++)
     {
-    case O_Ap: /* No ModR/M byte; address encoded in imm in the form of
-                * seg:ptr */
-        if (cpu_size == OPR_16BIT)
+        unsigned int next = (i + 1 < n)? code_begin[i + 1] : 0;
+        unsigned int e = x86_length_table[(code_begin[i] << 8) | next];
+
+        if (e & LENGTH_SLOW)
         {
-            uint16_t off = read_word(rd);
-            uint16_t seg = read_word(rd);
-            fill_ptr(opr, OPR_32BIT, seg, off);
+            len = superset_length_slow(code_begin + i, code_end, opt, &flow);
         }
         else
         {
-            return 0;
+            /* The table does not record why an entry is invalid, so only
+             * a truncation is counted as a failure here. */
+            STAT_HIT(decodes);
+            STAT_HIT(opcode[code_begin[i]]);
+            len = e & 0x0F;
+            flow = e >> 4;
+            if (len == 0)
+            {
+                len = -1;
+            }
+            else if ((size_t)len > n - i)
+            {
+                STAT_HIT(failure[X86_FAIL_TRUNCATED]);
+                len = -1;
+            }
         }
-        break;
-
-    case O_Eb:
-        /* The operand is either a general-purpose register or a memory
-         * address, encoded by ModR/M + SIB + displacement. The size of 
-         * the operand is byte.
-         */
-        return decode_memory_operand(opr, rd, OPR_8BIT, R_TYPE_GENERAL, cpu_size, pfx);
-
-    case O_Ep:
-        /* The operand is either a general-purpose register or a memory
-         * address, encoded by ModR/M + SIB + displacement. The size of 
-         * the operand is far pointer.
-         */
-        if (cpu_size == OPR_16BIT)
-            return decode_memory_operand(opr, rd, OPR_32BIT, R_TYPE_GENERAL, cpu_size, pfx);
-        else
-            return 0;
-        break;
-
-    case O_Ev:
-        /* The operand is either a general-purpose register or a memory
-         * address, encoded by ModR/M + SIB + displacement. The size of 
-         * the operand is the native word size of the CPU.
-         */
-        return decode_memory_operand(opr, rd, cpu_size, R_TYPE_GENERAL, cpu_size, pfx);
-
-    case O_Ew:
-        /* The operand is either a general-purpose register or a memory
-         * address, encoded by ModR/M + SIB + displacement. The size of 
-         * the operand is word.
-         */
-        return decode_memory_operand(opr, rd, OPR_16BIT, R_TYPE_GENERAL, cpu_size, pfx);
-
-    case O_Gb:
-        /* REG(modrm) selects byte-size GPR. */
-        /* TBD: check AH-DH */
-        modrm = read_modrm(rd);
-        FILL_REG(opr, REG_CONVERT_BYTE(REG(modrm)));
-        break;
-
-    case O_Gv:
-        /* REG(modrm) selects GPR of native size (16, 32, or 64 bit) */
-        modrm = read_modrm(rd);
-        FILL_REG(opr, REG_MAKE(R_TYPE_GENERAL, REG(modrm), cpu_size, 0));
-        break;
-
-    case O_Gw:
-        /* REG(modrm) selects word-size GPR. */
-        modrm = read_modrm(rd);
-        reg = REG_MAKE(R_TYPE_GENERAL, REG(modrm), OPR_16BIT, 0);
-        FILL_REG(opr, reg);
-        break;
-
-    case O_Gz:
-        /* REG(modrm) selects word-size GPR for 16-bit, dword-size GPR for
-         * 32 or 64 bit. 
-         */
-        modrm = read_modrm(rd);
-        reg = REG_MAKE(R_TYPE_GENERAL, REG(modrm), 
-                CPU_SIZE(opt) == OPR_16BIT ? OPR_16BIT : OPR_32BIT, 0);
-        FILL_REG(opr, reg);
-        break;
-
-    case O_Ib: /* byte immediate */
-        FILL_IMM(opr, OPR_8BIT, read_byte(rd));
-        break;
-
-    case O_Iv: /* native size immediate */
-        FILL_IMM(opr, cpu_size, read_imm(rd, cpu_size));
-        break;
-
-    case O_Iw: /* word immediate */
-        FILL_IMM(opr, OPR_16BIT, read_word(rd));
-        break;
-
-    case O_Iz: /* native or dword, whichever is smaller */
-        if (cpu_size == OPR_16BIT)
-            FILL_IMM(opr, OPR_16BIT, read_word(rd));
-        else
-            FILL_IMM(opr, OPR_32BIT, read_dword(rd));
-        break;
+        lengths[i] = (signed char)((len < 0)? -1 : len);
+        if (flows)
+            flows[i] = (unsigned char)((len < 0)? X86_FLOW_NONE : flow);
+    }
+}
 
-    case O_Jb: /* immediate encodes relative offset (byte) */
-        FILL_REL(opr, OPR_8BIT, (int8_t)read_byte(rd));
-        break;
+/* Returns the name of an operand spec (enum x86_opr_spec) for display. */
+static const char *opr_spec_name(int spec, char buf[8])
+{
+    static const char *general[] =
+    {
+        "NONE", "Ap", "Eb", "Ep", "Ev", "Ew", "Fv", "Gb", "Gv", "Gw", "Gz",
+        "Ib", "Iv", "Iw", "Iz", "Jb", "Jz", "Ma", "Mp", "Mw", "Ob", "Ov",
+        "Rv", "Sw", "Xb", "Xv", "Xz", "Yb", "Yv", "Yz"
+    };
+    static const char *sreg[] = { "ES", "CS", "SS", "DS", "FS", "GS" };
+    static const char *greg[] = { "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI" };
+    static const char *breg[] = { "AL", "CL", "DL", "BL", "AH", "CH", "DH", "BH" };
+
+    if (spec < (int)(sizeof(general) / sizeof(general[0])))
+        return general[spec];
+    if (spec >= O_n && spec < O_n + 16)
+        sprintf(buf, "%d", spec - O_n);
+    else if (spec >= O_XS && spec < O_XS + 6)
+        return sreg[spec - O_XS];
+    else if (spec >= O_XL && spec < O_XL + 8)
+        return breg[spec - O_XL];
+    else if (spec >= O_XX && spec < O_XX + 8)
+        return greg[spec - O_XX];
+    else if (spec >= O_eXX && spec < O_eXX + 8)
+        sprintf(buf, "e%s", greg[spec - O_eXX]);
+    else if (spec >= O_rXX && spec < O_rXX + 8)
+        sprintf(buf, "r%s", greg[spec - O_rXX]);
+    else
+        sprintf(buf, "%02X", spec);
+    return buf;
+}
 
-    case O_Jz: /* immediate encodes relative offset (word or dword) */
-        if (cpu_size == OPR_16BIT)
-            FILL_REL(opr, OPR_16BIT, (int16_t)read_word(rd));
-        else
-            FILL_REL(opr, OPR_32BIT, (int32_t)read_dword(rd));
-        break;
-        
-    case O_Mp: /* ModR/M refers to memory containing far pointer seg:ptr
-                * of 32, 48, or 80 bits.
-                */
-        if (cpu_size == OPR_16BIT)
-            return decode_memory_operand(opr, rd, OPR_32BIT, 0, cpu_size, pfx);
-        else
-            return 0;
+const x86_decode_stats_t *x86_get_decode_stats(void)
+{
+#ifdef X86_DECODE_STATS
+    return &x86_stats;
+#else
+    return NULL;
+#endif
+}
 
-    case O_Ob: /* no ModR/M byte; absolute memory address in disp as
-                * 16-bit or 32-bit near ptr
-                */
-        if (cpu_size == OPR_16BIT)
-            FILL_MEM(opr, OPR_8BIT, R_DS, R_NONE, R_NONE, 1, read_word(rd));
-        else
-            FILL_MEM(opr, OPR_8BIT, R_DS, R_NONE, R_NONE, 1, read_dword(rd));
-        break;
-
-    case O_Ov: /* no ModR/M byte; absolute memory address (native word)
-                * encoded in displacement of either word or dword.
-                */
-        /* TBD: operand size prefix */
-        if (cpu_size == OPR_16BIT)
-            FILL_MEM(opr, cpu_size, R_DS, R_NONE, R_NONE, 1, read_word(rd));
-        else
-            FILL_MEM(opr, cpu_size, R_DS, R_NONE, R_NONE, 1, read_dword(rd));
-        break;
-        
-    case O_Sw: /* REG(modrm) selects segment register */
-        modrm = read_modrm(rd);
-        reg = REG_MAKE(R_TYPE_SEGMENT, REG(modrm), OPR_16BIT, 0);
-        FILL_REG(opr, reg);
-        break;
-
-    case O_Xb: /* memory addressed by DS:rSI; byte */
-        FILL_MEM(opr, OPR_8BIT, R_DS, REG_RESIZE(R_SI, cpu_size), 0, 1, 0);
-        break;
-
-    case O_Xv: /* memory addressed by DS:rSI; native */
-        FILL_MEM(opr, cpu_size, R_DS, REG_RESIZE(R_SI, cpu_size), 0, 1, 0);
-        break;
-
-    case O_Yb: /* memory addressed by ES:rDI; byte */
-        FILL_MEM(opr, OPR_8BIT, R_ES, REG_RESIZE(R_DI, cpu_size), 0, 1, 0);
-        break;
-
-    case O_Yv: /* memory addressed by ES:rDI; native */
-        FILL_MEM(opr, cpu_size, R_ES, REG_RESIZE(R_DI, cpu_size), 0, 1, 0);
-        break;
-
-    default:
-        return 0; /* invalid specification */
-    }
-    return 1;
+void x86_reset_decode_stats(void)
+{
+#ifdef X86_DECODE_STATS
+    static const x86_decode_stats_t zero;
+    x86_stats = zero;
+#endif
 }
 
-int x86_decode(
-    const unsigned char *code_begin,
-    const unsigned char *code_end,
-    x86_insn_t *insn, 
-    const x86_options_t *opt)
+void x86_dump_decode_stats(void)
 {
-    x86_insn_reader_t rd;
-    x86_insn_spec_t spec;
+    static const char *ext_name[] =
+    {
+        "EXT1", "EXT1A", "EXT2", "EXT3", "EXT4", "EXT5", "EXT6", "EXT7",
+        "EXT8", "EXT11"
+    };
+    static const char *failure_name[X86_FAIL_COUNT] =
+    {
+        "unsupported mode", "invalid opcode", "invalid operand", "truncated"
+    };
+    const x86_decode_stats_t *st = x86_get_decode_stats();
+    char buf[8];
     int i;
-    int count;
 
-    /* Clear instruction. */
-    memset(insn, 0, sizeof(x86_insn_t));
-
-    /* Initialize reader. */
-    init_reader(&rd, code_begin, code_end);
+    if (st == NULL)
+    {
+        printf("Decoder statistics are not available; "
+               "compile with X86_DECODE_STATS.\n");
+        return;
+    }
 
-    /* Decode prefixes. */
-    insn->pfx = decode_prefix(&rd, opt);
+    printf("Decodes: %lu\n", st->decodes);
 
-    /* Decode the opcode and get encoding specification. */
-    spec = decode_opcode(&rd, CPU_SIZE(opt));
-    if (SPEC_INSN(spec) == 0)
-        return -1;
-    insn->op = SPEC_INSN(spec);
+    printf("Opcode hits:\n");
+    for (i = 0; i < 256; i++)
+    {
+        if (st->opcode[i])
+            printf("  %02X      %10lu\n", i, st->opcode[i]);
+    }
 
-    /* Decode operands. */
-    for (i = 0; i < MAX_OPERANDS; i++)
+    printf("Opcode extension group hits:\n");
+    for (i = 0; i < (int)(sizeof(ext_name) / sizeof(ext_name[0])); i++)
     {
-        int opr_spec = SPEC_OPERAND(spec, i);
-        if (opr_spec == 0) /* no more operands */
-            break;
+        if (st->ext[i])
+            printf("  %-7s %10lu\n", ext_name[i], st->ext[i]);
+    }
 
-        if (!decode_operand(&insn->oprs[i], &rd, opr_spec, insn->pfx, opt)) /* failed */
-            return -1;
+    printf("Operand spec hits:\n");
+    for (i = 0; i < 256; i++)
+    {
+        if (st->operand[i])
+            printf("  %-7s %10lu\n", opr_spec_name(i, buf), st->operand[i]);
     }
 
-    /* Compute the number of bytes consumed, and check that it does not
-     * overflow the supplied buffer. */
-    count = rd.end - rd.prefix;
-    if (count > code_end - code_begin)
-        return -1;
-    else
-        return count;
+    printf("Failures:\n");
+    for (i = 0; i < X86_FAIL_COUNT; i++)
+    {
+        printf("  %-16s %10lu\n", failure_name[i], st->failure[i]);
+    }
 }
@@ -3,173 +3,226 @@
 #include "x86_codec.h"
 
 #include <string.h>
-#include <stdio.h>
 
-static const char *insn_str[] = 
+/*
+ * A name to emit, padded with NULs to 8 bytes so that it can be copied as a
+ * single 64-bit word. Names only contain upper-case letters, digits and
+ * spaces, so OR-ing every byte with 0x20 turns a name into lower case.
+ */
+typedef struct fmt_token_t
+{
+    char text[8];
+    unsigned char len;
+} fmt_token_t;
+
+#define TOK(s)      { s, sizeof(s) - 1 }
+#define TOK_EMPTY   { "", 0 }
+
+/* Mnemonics, indexed by enum x86_insn_mnemonic. */
+static const fmt_token_t insn_tokens[] = 
 {
-    "NONE",
-#define I(x) #x ,
+    TOK("NONE"),
+#define I(x, flow, attr, regs_read, regs_written, flags_read, flags_written) \
+    TOK(#x),
 #include "x86_mnemonic.inc"
 #undef I
-    "XXXX"
+    TOK("XXXX")
 };
 
-static const char *getRegString(x86_reg_t reg)
+/*
+ * Register names, indexed by REG_TYPE(), REG_SIZE() - OPR_8BIT, and
+ * REG_NUMBER() of a register with zero offset. An empty entry is not a
+ * register.
+ */
+static const fmt_token_t reg_tokens[8][5][16] =
+{
+    /* R_TYPE_SPECIAL */ {
+        /* 8-bit */ { TOK_EMPTY },
+        /* 16-bit */ { TOK_EMPTY, TOK("IP"), TOK("FLAGS") },
+        /* 32-bit */ { TOK_EMPTY, TOK("EIP"), TOK("EFLAGS"), TOK("MXCSR") }
+    },
+    /* R_TYPE_GENERAL */ {
+        /* 8-bit */ {
+            TOK("AL"), TOK("CL"), TOK("DL"), TOK("BL"),
+            TOK("SPL"), TOK("BPL"), TOK("SIL"), TOK("DIL"),
+            TOK("R8L"), TOK("R9L"), TOK("R10L"), TOK("R11L"),
+            TOK("R12L"), TOK("R13L"), TOK("R14L"), TOK("R15L")
+        },
+        /* 16-bit */ {
+            TOK("AX"), TOK("CX"), TOK("DX"), TOK("BX"),
+            TOK("SP"), TOK("BP"), TOK("SI"), TOK("DI"),
+            TOK("R8W"), TOK("R9W"), TOK("R10W"), TOK("R11W"),
+            TOK("R12W"), TOK("R13W"), TOK("R14W"), TOK("R15W")
+        },
+        /* 32-bit */ {
+            TOK("EAX"), TOK("ECX"), TOK("EDX"), TOK("EBX"),
+            TOK("ESP"), TOK("EBP"), TOK("ESI"), TOK("EDI"),
+            TOK("R8D"), TOK("R9D"), TOK("R10D"), TOK("R11D"),
+            TOK("R12D"), TOK("R13D"), TOK("R14D"), TOK("R15D")
+        },
+        /* 64-bit */ {
+            TOK("RAX"), TOK("RCX"), TOK("RDX"), TOK("RBX"),
+            TOK("RSP"), TOK("RBP"), TOK("RSI"), TOK("RDI"),
+            TOK("R8"), TOK("R9"), TOK("R10"), TOK("R11"),
+            TOK("R12"), TOK("R13"), TOK("R14"), TOK("R15")
+        }
+    },
+    /* R_TYPE_SEGMENT */ {
+        /* 8-bit */ { TOK_EMPTY },
+        /* 16-bit */ {
+            TOK("ES"), TOK("CS"), TOK("SS"), TOK("DS"), TOK("FS"), TOK("GS")
+        }
+    },
+    /* R_TYPE_CONTROL; see Volume 2, Appendix B, Table B-9. */ {
+        /* 8-bit */ { TOK_EMPTY },
+        /* 16-bit */ {
+            TOK("CR0"), TOK_EMPTY, TOK("CR2"), TOK("CR3"), TOK("CR4")
+        }
+    },
+    /* R_TYPE_DEBUG; see Volume 2, Appendix B, Table B-9. */ {
+        /* 8-bit */ { TOK_EMPTY },
+        /* 16-bit */ {
+            TOK("DR0"), TOK("DR1"), TOK("DR2"), TOK("DR3"),
+            TOK_EMPTY, TOK_EMPTY, TOK("DR6"), TOK("DR7")
+        }
+    },
+    /* R_TYPE_MMX */ {
+        /* 8-bit */ { TOK_EMPTY },
+        /* 16-bit */ { TOK_EMPTY },
+        /* 32-bit */ { TOK_EMPTY },
+        /* 64-bit */ {
+            TOK("MM0"), TOK("MM1"), TOK("MM2"), TOK("MM3"),
+            TOK("MM4"), TOK("MM5"), TOK("MM6"), TOK("MM7")
+        }
+    },
+    /* R_TYPE_XMM */ {
+        /* 8-bit */ { TOK_EMPTY },
+        /* 16-bit */ { TOK_EMPTY },
+        /* 32-bit */ { TOK_EMPTY },
+        /* 64-bit */ { TOK_EMPTY },
+        /* 128-bit */ {
+            TOK("XMM0"), TOK("XMM1"), TOK("XMM2"), TOK("XMM3"),
+            TOK("XMM4"), TOK("XMM5"), TOK("XMM6"), TOK("XMM7"),
+            TOK("XMM8"), TOK("XMM9"), TOK("XMM10"), TOK("XMM11"),
+            TOK("XMM12"), TOK("XMM13"), TOK("XMM14"), TOK("XMM15")
+        }
+    },
+    /* R_TYPE_YMM */ {
+        /* 8-bit */ { TOK_EMPTY }
+    }
+};
+
+/* High byte registers AH-DH, indexed by REG_NUMBER(). */
+static const fmt_token_t hibyte_tokens[4] = 
+{
+    TOK("AH"), TOK("CH"), TOK("DH"), TOK("BH")
+};
+
+static const fmt_token_t none_token = TOK("NONE");
+static const fmt_token_t invalid_token = TOK("INVALID");
+
+/* Size keywords of memory operands, indexed by enum x86_opr_size. */
+static const fmt_token_t size_tokens[16] =
+{
+    TOK_EMPTY, TOK_EMPTY, TOK_EMPTY, TOK("BYTE"),
+    TOK("WORD"), TOK("DWORD"), TOK("QWORD"), TOK("DQWORD")
+};
+
+static const fmt_token_t ptr_token = TOK(" PTR ");
+static const fmt_token_t lock_token = TOK("LOCK ");
+static const fmt_token_t repnz_token = TOK("REPNZ ");
+static const fmt_token_t rep_token = TOK("REP ");
+
+/* Looks up the name of a register. */
+static const fmt_token_t *
+get_reg_token(x86_reg_t reg)
 {
-#define CASE_REG(r) case R_##r : return #r 
-    switch (reg)
+    const fmt_token_t *t;
+    int type = REG_TYPE(reg), size = REG_SIZE(reg), number = REG_NUMBER(reg);
+
+    if (reg == R_NONE)
+        return &none_token;
+
+    if (REG_OFFSET(reg) == R_OFFSET_HIBYTE)
     {
-        CASE_REG(NONE);
-
-        /* byte registers */
-        CASE_REG(AH);
-        CASE_REG(CH);
-        CASE_REG(DH);
-        CASE_REG(BH);
-        CASE_REG(AL);
-        CASE_REG(CL);
-        CASE_REG(DL);
-        CASE_REG(BL);
-        CASE_REG(SPL);
-        CASE_REG(BPL);
-        CASE_REG(SIL);
-        CASE_REG(DIL);
-        CASE_REG(R8L);
-        CASE_REG(R9L);
-        CASE_REG(R10L);
-        CASE_REG(R11L);
-        CASE_REG(R12L);
-        CASE_REG(R13L);
-        CASE_REG(R14L);
-        CASE_REG(R15L);
-
-        /* word registers */
-        CASE_REG(AX);
-        CASE_REG(CX);
-        CASE_REG(DX);
-        CASE_REG(BX);
-        CASE_REG(SP);
-        CASE_REG(BP);
-        CASE_REG(SI);
-        CASE_REG(DI);
-        CASE_REG(R8W);
-        CASE_REG(R9W);
-        CASE_REG(R10W);
-        CASE_REG(R11W);
-        CASE_REG(R12W);
-        CASE_REG(R13W);
-        CASE_REG(R14W);
-        CASE_REG(R15W);
-    
-        /* dword registers */
-        CASE_REG(EAX);
-        CASE_REG(ECX);
-        CASE_REG(EDX);
-        CASE_REG(EBX);
-        CASE_REG(ESP);
-        CASE_REG(EBP);
-        CASE_REG(ESI);
-        CASE_REG(EDI);
-        CASE_REG(R8D);
-        CASE_REG(R9D);
-        CASE_REG(R10D);
-        CASE_REG(R11D);
-        CASE_REG(R12D);
-        CASE_REG(R13D);
-        CASE_REG(R14D);
-        CASE_REG(R15D);
-
-        /* qword registers */
-        CASE_REG(RAX);
-        CASE_REG(RCX);
-        CASE_REG(RDX);
-        CASE_REG(RBX);
-        CASE_REG(RSP);
-        CASE_REG(RBP);
-        CASE_REG(RSI);
-        CASE_REG(RDI);
-        CASE_REG(R8);
-        CASE_REG(R9);
-        CASE_REG(R10);
-        CASE_REG(R11);
-        CASE_REG(R12);
-        CASE_REG(R13);
-        CASE_REG(R14);
-        CASE_REG(R15);
-
-        /* segment registers */
-        CASE_REG(ES);
-        CASE_REG(CS);
-        CASE_REG(SS);
-        CASE_REG(DS);
-        CASE_REG(FS);
-        CASE_REG(GS);
- 
-        /* Control registers (eee). See Volume 2, Appendix B, Table B-9. */
-        CASE_REG(CR0);
-        CASE_REG(CR2);
-        CASE_REG(CR3);
-        CASE_REG(CR4);
-
-        /* Debug registers (eee). See Volume 2, Appendix B, Table B-9. */
-        CASE_REG(DR0);
-        CASE_REG(DR1);
-        CASE_REG(DR2);
-        CASE_REG(DR3);
-        CASE_REG(DR6);
-        CASE_REG(DR7);
-
-        /* MMX registers. */
-        CASE_REG(MM0);
-        CASE_REG(MM1);
-        CASE_REG(MM2);
-        CASE_REG(MM3);
-        CASE_REG(MM4);
-        CASE_REG(MM5);
-        CASE_REG(MM6);
-        CASE_REG(MM7);
-
-        /* XMM registers. */
-        CASE_REG(XMM0);
-        CASE_REG(XMM1);
-        CASE_REG(XMM2);
-        CASE_REG(XMM3);
-        CASE_REG(XMM4);
-        CASE_REG(XMM5);
-        CASE_REG(XMM6);
-        CASE_REG(XMM7);
-        CASE_REG(XMM8);
-        CASE_REG(XMM9);
-        CASE_REG(XMM10);
-        CASE_REG(XMM11);
-        CASE_REG(XMM12);
-        CASE_REG(XMM13);
-        CASE_REG(XMM14);
-        CASE_REG(XMM15);
-
-        /* Special registers. */
-        CASE_REG(IP);
-        CASE_REG(FLAGS);
-        CASE_REG(EIP);
-        CASE_REG(EFLAGS);
-        CASE_REG(MXCSR);
+        if (type == R_TYPE_GENERAL && size == OPR_8BIT && number < 4)
+            return &hibyte_tokens[number];
+        return &invalid_token;
     }
-    return "INVALID";
-#undef CASE_REG
+
+    if (REG_OFFSET(reg) != R_OFFSET_NONE || type >= 8 ||
+        size < OPR_8BIT || size > OPR_128BIT)
+        return &invalid_token;
+
+    t = &reg_tokens[type][size - OPR_8BIT][number];
+    return (t->len != 0)? t : &invalid_token;
 }
 
+/* Copies a name in the case selected by _fmt_, and returns the end of the
+ * name. Up to 8 bytes are written, so the buffer needs some slack.
+ */
 static char *
-copy_string_and_change_case(const char *src, char *dest, x86_fmt_t fmt)
+emit_token(const fmt_token_t *tok, char *p, x86_fmt_t fmt)
 {
-    /* Turn to lower case if necessary. */
-    for (; *src; dest++, src++)
+    uint64_t w;
+
+    memcpy(&w, tok->text, 8);
+    if (X86_FMT_CASE(fmt) == X86_FMT_LOWER)
+        w |= 0x2020202020202020ULL;
+    memcpy(p, &w, 8);
+    return p + tok->len;
+}
+
+const char *x86_reg_name(x86_reg_t reg, size_t *len)
+{
+    const fmt_token_t *t = get_reg_token(reg);
+    if (len)
+        *len = t->len;
+    return t->text;
+}
+
+const char *x86_mnemonic_name(int op, size_t *len)
+{
+    const int N = sizeof(insn_tokens) / sizeof(insn_tokens[0]);
+    const fmt_token_t *t = (op >= 0 && op < N)? &insn_tokens[op] : &invalid_token;
+    if (len)
+        *len = t->len;
+    return t->text;
+}
+
+static const char hex_digits[16] = 
+{
+    '0', '1', '2', '3', '4', '5', '6', '7', 
+    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+/* Writes _value_ in decimal and returns the end of the text. */
+static char *
+format_dec(uint32_t value, char *p)
+{
+    char digits[10];
+    int n = 0;
+
+    do
     {
-        if (*src >= 'A' && *src <= 'Z')
-            *dest = *src - 'A' + 'a';
-        else
-            *dest = *src;
-    }
-    return dest;
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+/* Writes _value_ as exactly four hexidecimal digits. */
+static char *
+format_hex16(uint16_t value, char *p)
+{
+    p[0] = hex_digits[(value >> 12) & 0xf];
+    p[1] = hex_digits[(value >> 8) & 0xf];
+    p[2] = hex_digits[(value >> 4) & 0xf];
+    p[3] = hex_digits[value & 0xf];
+    return p + 4;
 }
 
 static char *
@@ -197,10 +250,7 @@ format_imm(uint32_t imm, char *p, x86_fmt_t fmt)
 
     /* Format each hexidecimal nibble. */
     for (; i >= 0; i -= 4)
-    {
-        int d = (imm >> i) & 0xf;
-        *p++ = (d < 10)? ('0' + d) : ('A' + d - 10);
-    }
+        *p++ = hex_digits[(imm >> i) & 0xf];
 
     /* Append hexidecimal mark. */
     *p++ = 'h';
@@ -211,16 +261,18 @@ static char *
 format_rel(int32_t rel, char *p, x86_fmt_t fmt)
 {
     if (rel >= 0)
+    {
         *p++ = '+';
-    sprintf(p, "%d", rel);
-    p += strlen(p);
-    return p;
+        return format_dec((uint32_t)rel, p);
+    }
+    *p++ = '-';
+    return format_dec(0u - (uint32_t)rel, p);
 }
 
 static char *
 format_reg(x86_reg_t reg, char *p, x86_fmt_t fmt)
 {
-    return copy_string_and_change_case(getRegString(reg), p, fmt);
+    return emit_token(get_reg_token(reg), p, fmt);
 }
 
 /* Formats a memory operand in the following form:
@@ -229,33 +281,29 @@ format_reg(x86_reg_t reg, char *p, x86_fmt_t fmt)
 static char *
 format_mem(const x86_opr_t *opr, char *p, x86_fmt_t fmt)
 {
-    const char *prefix = 
-        (opr->size == OPR_8BIT)? "BYTE" :
-        (opr->size == OPR_16BIT)? "WORD" :
-        (opr->size == OPR_32BIT)? "DWORD" :
-        (opr->size == OPR_64BIT)? "QWORD" :
-        (opr->size == OPR_128BIT)? "DQWORD" : "";
     const x86_mem_t *mem = &opr->val.mem;
 
-    p = copy_string_and_change_case(prefix, p, fmt);
-    p = copy_string_and_change_case(" PTR ", p, fmt);
+    p = emit_token(&size_tokens[opr->size & 0xf], p, fmt);
+    p = emit_token(&ptr_token, p, fmt);
     if (mem->segment)
     {
-        p = copy_string_and_change_case(getRegString(mem->segment), p, fmt);
+        p = format_reg(mem->segment, p, fmt);
         *p++ = ':';
     }
     *p++ = '[';
-    if (mem->base == R_NONE) /* only displacement */
+    if (mem->base == R_NONE && mem->index == R_NONE) /* only displacement */
     {
         p = format_imm(mem->displacement, p, fmt);
     }
     else
     {
-        p = copy_string_and_change_case(getRegString(mem->base), p, fmt);
-        if (mem->index)
+        if (mem->base != R_NONE)
+            p = format_reg(mem->base, p, fmt);
+        if (mem->index) /* e.g. [EBX+ESI*4] or [ESI*4] */
         {
-            *p++ = '+';
-            p = copy_string_and_change_case(getRegString(mem->index), p, fmt);
+            if (mem->base != R_NONE)
+                *p++ = '+';
+            p = format_reg(mem->index, p, fmt);
             if (mem->scaling > 1)
             {
                 *p++ = '*';
@@ -280,22 +328,38 @@ format_mem(const x86_opr_t *opr, char *p, x86_fmt_t fmt)
 static char *
 format_ptr(const x86_opr_t *opr, char *p, x86_fmt_t fmt)
 {
-    sprintf(p, "%04X", opr->val.ptr.seg);
-    p += 4;
+    p = format_hex16(opr->val.ptr.seg, p);
     *p++ = ':';
 
     if (opr->size == OPR_32BIT)
-    {
-        sprintf(p, "%04X", (uint16_t)opr->val.ptr.off);
-        p += 4;
-    }
+        p = format_hex16((uint16_t)opr->val.ptr.off, p);
     
     return p;
 }
 
+/* Context for formatting the operands of an instruction symbolically. */
+typedef struct fmt_context_t
+{
+    uint32_t base;                  /* linear address of the code segment */
+    uint16_t next;                  /* offset after the instruction */
+    const x86_symbolizer_t *sym;    /* NULL to format all operands as numbers */
+} fmt_context_t;
+
+/* Writes the label of _address_ if it has one, and returns the end of the
+ * text; returns NULL if there is no label.
+ */
 static char *
-format_operand(const x86_opr_t *opr, char *p, x86_fmt_t fmt)
+format_label(const fmt_context_t *ctx, uint32_t address, char *p)
 {
+    size_t n = ctx->sym->label(ctx->sym->arg, address, p);
+    return (n > 0)? p + n : NULL;
+}
+
+static char *
+format_operand(const x86_opr_t *opr, const fmt_context_t *ctx, char *p, x86_fmt_t fmt)
+{
+    char *q;
+
     switch (opr->type)
     {
     case OPR_REG:
@@ -305,45 +369,53 @@ format_operand(const x86_opr_t *opr, char *p, x86_fmt_t fmt)
     case OPR_IMM:
         return format_imm(opr->val.imm, p, fmt);
     case OPR_REL:
+        if (ctx->sym && (q = format_label(ctx,
+                ctx->base + (uint16_t)(ctx->next + opr->val.rel), p)) != NULL)
+            return q;
         return format_rel(opr->val.rel, p, fmt);
     case OPR_PTR:
+        if (ctx->sym && (q = format_label(ctx,
+                (uint32_t)opr->val.ptr.seg * 16 + (uint16_t)opr->val.ptr.off, p)) != NULL)
+            return q;
         return format_ptr(opr, p, fmt);
     default:
         return p;
     }
 }
 
-void x86_format(const x86_insn_t *insn, char buffer[256], x86_fmt_t fmt)
+/* Formats an instruction into _buffer_ and returns the end of the text,
+ * which is not NUL-terminated. The buffer must hold X86_FORMAT_BUFSIZE bytes.
+ */
+static char *
+format_insn(const x86_insn_t *insn, const fmt_context_t *ctx, char *buffer, x86_fmt_t fmt)
 {
-    const int N = sizeof(insn_str) / sizeof(insn_str[0]);
+    static const char invalid[] = "**** INVALID INSTRUCTION ****";
+    const int N = sizeof(insn_tokens) / sizeof(insn_tokens[0]);
     char *p = buffer;
     int i;
 
-    buffer[0] = 0;
-
     /* Format prefix. */
     if (insn->pfx & PFX_GROUP1)
     {
-        const char *s = 0;
+        const fmt_token_t *t = 0;
         switch (insn->pfx & PFX_GROUP1)
         {
-        case PFX_LOCK:  s = "LOCK ";  break;
-        case PFX_REPNZ: s = "REPNZ "; break;
-        case PFX_REP:   s = "REP ";   break;
+        case PFX_LOCK:  t = &lock_token;  break;
+        case PFX_REPNZ: t = &repnz_token; break;
+        case PFX_REP:   t = &rep_token;   break;
         }
-        if (s)
-            p = copy_string_and_change_case(s, p, fmt);
+        if (t)
+            p = emit_token(t, p, fmt);
     }
 
     /* Format mnemonic. */
     if (!(insn->op >= 0 && insn->op < N))
     {
-        strcpy(buffer, "**** INVALID INSTRUCTION ****");
-        return;
+        memcpy(buffer, invalid, sizeof(invalid) - 1);
+        return buffer + (sizeof(invalid) - 1);
     }
 
-    /* Turn to lower case if necessary. */
-    p = copy_string_and_change_case(insn_str[insn->op], p, fmt);
+    p = emit_token(&insn_tokens[insn->op], p, fmt);
 
     /* Format operands. */
     for (i = 0; i < MAX_OPERANDS; i++)
@@ -358,9 +430,75 @@ void x86_format(const x86_insn_t *insn, char buffer[256], x86_fmt_t fmt)
         *p++ = ' ';
 
         /* Format operand. */
-        p = format_operand(&insn->oprs[i], p, fmt);
+        p = format_operand(&insn->oprs[i], ctx, p, fmt);
+    }
+    return p;
+}
+
+/* Formats an instruction into a buffer of _size_ bytes, truncating the
+ * text as snprintf() does.
+ */
+static size_t
+format_insn_n(
+    const x86_insn_t *insn,
+    const fmt_context_t *ctx,
+    char *buffer,
+    size_t size,
+    x86_fmt_t fmt)
+{
+    char scratch[X86_FORMAT_BUFSIZE];
+    size_t len, n;
+
+    /* Format in place if the text is sure to fit. */
+    if (size >= X86_FORMAT_BUFSIZE)
+    {
+        char *p = format_insn(insn, ctx, buffer, fmt);
+        *p = 0;
+        return p - buffer;
+    }
+
+    /* Otherwise format into scratch space and copy as much as fits. */
+    len = format_insn(insn, ctx, scratch, fmt) - scratch;
+    if (size > 0)
+    {
+        n = (len < size)? len : size - 1;
+        memcpy(buffer, scratch, n);
+        buffer[n] = 0;
     }
+    return len;
+}
+
+size_t x86_format_insn(
+    const x86_insn_t *insn,
+    char *buffer,
+    size_t size,
+    x86_fmt_t fmt)
+{
+    fmt_context_t ctx;
+    ctx.base = 0;
+    ctx.next = 0;
+    ctx.sym = NULL;
+    return format_insn_n(insn, &ctx, buffer, size, fmt);
+}
 
-    /* NUL-terminate the string. */
-    *p = 0;
+size_t x86_format_symbolic(
+    const x86_insn_t *insn,
+    uint32_t base,
+    uint16_t ip,
+    int length,
+    const x86_symbolizer_t *sym,
+    char *buffer,
+    size_t size,
+    x86_fmt_t fmt)
+{
+    fmt_context_t ctx;
+    ctx.base = base;
+    ctx.next = (uint16_t)(ip + length);
+    ctx.sym = sym;
+    return format_insn_n(insn, &ctx, buffer, size, fmt);
+}
+
+void x86_format(const x86_insn_t *insn, char buffer[256], x86_fmt_t fmt)
+{
+    x86_format_insn(insn, buffer, X86_FORMAT_BUFSIZE, fmt);
 }
@@ -0,0 +1,80 @@
+/* insn_info.c -- static semantics of each mnemonic. */
+
+#include "x86_codec.h"
+
+/* Short names used by the entries in x86_mnemonic.inc. */
+#define COND    X86_INSN_COND
+#define NEAR    X86_INSN_NEAR
+#define FAR     X86_INSN_FAR
+
+#define AX      X86_REGSET_AX
+#define CX      X86_REGSET_CX
+#define DX      X86_REGSET_DX
+#define BX      X86_REGSET_BX
+#define SP      X86_REGSET_SP
+#define BP      X86_REGSET_BP
+#define SI      X86_REGSET_SI
+#define DI      X86_REGSET_DI
+#define ES      X86_REGSET_ES
+#define CS      X86_REGSET_CS
+#define DS      X86_REGSET_DS
+#define GPRS    0x00FF
+
+#define CF      X86_FLAG_CF
+#define PF      X86_FLAG_PF
+#define AF      X86_FLAG_AF
+#define ZF      X86_FLAG_ZF
+#define SF      X86_FLAG_SF
+#define TF      X86_FLAG_TF
+#define IF      X86_FLAG_IF
+#define DF      X86_FLAG_DF
+#define OF      X86_FLAG_OF
+#define ARITH   (CF|PF|AF|ZF|SF|OF)
+#define ALL     (ARITH|TF|IF|DF)
+
+const x86_insn_info_t x86_insn_info[I_XXXX + 1] =
+{
+    { X86_FLOW_NONE, 0, 0, 0, 0, 0 }, /* I_NONE */
+#define I(insn, flow, attr, regs_read, regs_written, flags_read, flags_written) \
+    { X86_FLOW_##flow, (attr), (regs_read), (regs_written), \
+      (flags_read), (flags_written) },
+#include "x86_mnemonic.inc"
+#undef I
+    { X86_FLOW_NONE, 0, 0, 0, 0, 0 }  /* I_XXXX */
+};
+
+void x86_insn_regs(
+    const x86_insn_t *insn,
+    uint16_t *regs_read,
+    uint16_t *regs_written)
+{
+    uint16_t r = x86_insn_info[insn->op].regs_read;
+    uint16_t w = x86_insn_info[insn->op].regs_written;
+    int wide = (insn->oprs[0].size != OPR_8BIT);
+
+    switch (insn->op)
+    {
+    /* The one-operand forms (F6 /4../7, F7 /4../7) are decoded with the
+     * accumulator as an explicit second operand. The byte forms also use AH
+     * (part of AX) and the wider forms use DX. The three-operand IMUL (69,
+     * 6B) accesses no register implicitly.
+     */
+    case I_MUL:
+    case I_IMUL:
+        if (insn->oprs[2].type == OPR_NONE)
+            w |= wide? DX : AX;
+        break;
+
+    case I_DIV:
+    case I_IDIV:
+        r |= wide? DX : AX;
+        w |= wide? DX : AX;
+        break;
+
+    default:
+        break;
+    }
+
+    *regs_read = r;
+    *regs_written = w;
+}
@@ -0,0 +1,185 @@
+/* pack.c -- packs decoded operands into compact payloads. */
+
+#include "x86_codec.h"
+
+#include <string.h>
+
+/* Fails to compile if the packed instruction is not 24 bytes. */
+typedef char x86_insn_packed_size_check[sizeof(x86_insn_packed_t) == 24 ? 1 : -1];
+
+unsigned char x86_pack_operand(const x86_opr_t *opr, uint64_t *data)
+{
+    const x86_mem_t *mem;
+    uint64_t d;
+
+    switch (opr->type)
+    {
+    case OPR_REG:
+        d = opr->val.reg;
+        break;
+    case OPR_IMM:
+        d = opr->val.imm;
+        break;
+    case OPR_REL:
+        d = (uint32_t)opr->val.rel;
+        break;
+    case OPR_PTR:
+        d = (uint32_t)opr->val.ptr.off | ((uint64_t)opr->val.ptr.seg << 32);
+        break;
+    case OPR_MEM:
+        mem = &opr->val.mem;
+        d = (uint32_t)mem->displacement
+            | ((uint64_t)(mem->base & 0xfff) << 32)
+            | ((uint64_t)(mem->index & 0xfff) << 44)
+            | ((uint64_t)(mem->segment? REG_NUMBER(mem->segment) + 1 : 0) << 56)
+            | ((uint64_t)(mem->scaling & 0xf) << 60);
+        break;
+    default:
+        *data = 0;
+        return 0;
+    }
+    *data = d;
+    return (unsigned char)X86_OPR_KIND(opr->type, opr->size);
+}
+
+void x86_unpack_operand(unsigned char kind, uint64_t data, x86_opr_t *opr)
+{
+    unsigned int seg;
+
+    opr->type = X86_OPR_KIND_TYPE(kind);
+    opr->size = X86_OPR_KIND_SIZE(kind);
+    switch (opr->type)
+    {
+    case OPR_REG:
+        opr->val.reg = (x86_reg_t)data;
+        break;
+    case OPR_IMM:
+        opr->val.imm = (uint32_t)data;
+        break;
+    case OPR_REL:
+        opr->val.rel = (int32_t)(uint32_t)data;
+        break;
+    case OPR_PTR:
+        opr->val.ptr.seg = (uint16_t)(data >> 32);
+        opr->val.ptr.off = (uint32_t)data;
+        break;
+    case OPR_MEM:
+        seg = X86_MEM_SEGMENT(data);
+        opr->val.mem.segment = seg? REG_MAKE(R_TYPE_SEGMENT, seg - 1, R_SIZE_16BIT, 0) : 0;
+        opr->val.mem.base = X86_MEM_BASE(data);
+        opr->val.mem.index = X86_MEM_INDEX(data);
+        opr->val.mem.scaling = X86_MEM_SCALING(data);
+        opr->val.mem.displacement = X86_MEM_DISP(data);
+        break;
+    default:
+        break;
+    }
+}
+
+void x86_batch_get(const x86_insn_batch_t *batch, size_t i, x86_insn_t *insn)
+{
+    int j;
+
+    insn->pfx = batch->prefix? batch->prefix[i] : 0;
+    insn->op = batch->mnemonic? (enum x86_insn_mnemonic)batch->mnemonic[i] : I_NONE;
+    for (j = 0; j < MAX_OPERANDS; j++)
+    {
+        x86_opr_t *opr = &insn->oprs[j];
+        if (batch->opr_kind && batch->opr_data)
+        {
+            x86_unpack_operand(batch->opr_kind[i * MAX_OPERANDS + j],
+                batch->opr_data[i * MAX_OPERANDS + j], opr);
+        }
+        else
+        {
+            opr->type = OPR_NONE;
+            opr->size = 0;
+        }
+    }
+}
+
+/* Returns the number of bytes an operand payload takes in a packed
+ * instruction.
+ */
+static int payload_size(unsigned char kind)
+{
+    switch (X86_OPR_KIND_TYPE(kind))
+    {
+    case OPR_REG:
+        return 2;
+    case OPR_MEM:
+        return 8;
+    case OPR_PTR:
+        return 6;
+    case OPR_IMM:
+    case OPR_REL:
+        return (X86_OPR_KIND_SIZE(kind) == OPR_8BIT)? 1 :
+            (X86_OPR_KIND_SIZE(kind) == OPR_16BIT)? 2 : 4;
+    default:
+        return 0;
+    }
+}
+
+/* Expands an operand whose payload is stored at _p_. */
+static void unpack_payload(unsigned char kind, const uint8_t *p, x86_opr_t *opr)
+{
+    int n = payload_size(kind);
+    uint64_t data = 0;
+
+    while (n > 0)
+        data = (data << 8) | p[--n];
+
+    /* A relative offset narrower than 32 bits must be sign-extended. */
+    if (X86_OPR_KIND_TYPE(kind) == OPR_REL)
+    {
+        if (X86_OPR_KIND_SIZE(kind) == OPR_8BIT)
+            data = (uint32_t)(int8_t)data;
+        else if (X86_OPR_KIND_SIZE(kind) == OPR_16BIT)
+            data = (uint32_t)(int16_t)data;
+    }
+    x86_unpack_operand(kind, data, opr);
+}
+
+int x86_insn_pack(const x86_insn_t *insn, x86_insn_packed_t *packed)
+{
+    int i, n, pos = 0;
+
+    packed->pfx = insn->pfx;
+    packed->op = (uint16_t)insn->op;
+    memset(packed->data, 0, sizeof(packed->data));
+    for (i = 0; i < MAX_OPERANDS; i++)
+    {
+        uint64_t data;
+        unsigned char kind = x86_pack_operand(&insn->oprs[i], &data);
+
+        packed->kind[i] = kind;
+        n = payload_size(kind);
+        if (pos + n > (int)sizeof(packed->data))
+            return 0;
+        for ( ; n > 0; n--, data >>= 8)
+            packed->data[pos++] = (uint8_t)data;
+    }
+    return 1;
+}
+
+void x86_insn_unpack(const x86_insn_packed_t *packed, x86_insn_t *insn)
+{
+    int i, pos = 0;
+
+    insn->pfx = packed->pfx;
+    insn->op = (enum x86_insn_mnemonic)packed->op;
+    for (i = 0; i < MAX_OPERANDS; i++)
+    {
+        unpack_payload(packed->kind[i], &packed->data[pos], &insn->oprs[i]);
+        pos += payload_size(packed->kind[i]);
+    }
+}
+
+void x86_packed_operand(const x86_insn_packed_t *packed, int i, x86_opr_t *opr)
+{
+    int j, pos = 0;
+
+    for (j = 0; j < i; j++)
+        pos += payload_size(packed->kind[j]);
+    unpack_payload(packed->kind[i], &packed->data[pos], opr);
+}
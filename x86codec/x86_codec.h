@@ -7,6 +7,7 @@
 
 /* #include "x86_register.h" */
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -506,7 +507,8 @@ enum x86_insn_mnemonic
 {
     I_NONE = 0,
 
-#define I(insn) I_##insn,
+#define I(insn, flow, attr, regs_read, regs_written, flags_read, flags_written) \
+    I_##insn,
 #include "x86_mnemonic.inc"
 #undef I
 
@@ -533,6 +535,285 @@ int x86_decode(
     x86_insn_t *insn, 
     const x86_options_t *opt);
 
+/* Enumerated values for the control flow class of an instruction. */
+enum x86_flow_class
+{
+    X86_FLOW_NONE   = 0,    /* execution continues with the next insn */
+    X86_FLOW_JUMP   = 1,    /* unconditional jump (JMP, JMPN, JMPF) */
+    X86_FLOW_CALL   = 2,    /* subroutine call (CALL, CALLN, CALLF) */
+    X86_FLOW_RET    = 3,    /* return (RET, RETN, RETF, IRET) */
+    X86_FLOW_JCC    = 4     /* conditional jump (Jcc, JCXZ, LOOPcc) */
+};
+
+/* Attributes of a mnemonic (x86_insn_info_t.attr). */
+enum x86_insn_attr
+{
+    X86_INSN_COND   = 1,    /* branch is taken only if a condition holds */
+    X86_INSN_NEAR   = 2,    /* every form transfers control within CS */
+    X86_INSN_FAR    = 4     /* every form loads a new CS */
+};
+
+/* Sets of registers accessed implicitly by an instruction. Bit _n_ stands
+ * for the general register numbered _n_ (rAX..rDI) in any size, and bit 8+_n_
+ * for the segment register numbered _n_ (ES..GS).
+ */
+enum x86_regset
+{
+    X86_REGSET_AX   = 0x0001,
+    X86_REGSET_CX   = 0x0002,
+    X86_REGSET_DX   = 0x0004,
+    X86_REGSET_BX   = 0x0008,
+    X86_REGSET_SP   = 0x0010,
+    X86_REGSET_BP   = 0x0020,
+    X86_REGSET_SI   = 0x0040,
+    X86_REGSET_DI   = 0x0080,
+    X86_REGSET_ES   = 0x0100,
+    X86_REGSET_CS   = 0x0200,
+    X86_REGSET_SS   = 0x0400,
+    X86_REGSET_DS   = 0x0800,
+    X86_REGSET_FS   = 0x1000,
+    X86_REGSET_GS   = 0x2000
+};
+
+/* Bits in the FLAGS register. */
+enum x86_flag
+{
+    X86_FLAG_CF     = 0x0001,
+    X86_FLAG_PF     = 0x0004,
+    X86_FLAG_AF     = 0x0010,
+    X86_FLAG_ZF     = 0x0040,
+    X86_FLAG_SF     = 0x0080,
+    X86_FLAG_TF     = 0x0100,
+    X86_FLAG_IF     = 0x0200,
+    X86_FLAG_DF     = 0x0400,
+    X86_FLAG_OF     = 0x0800
+};
+
+/* Static semantics of a mnemonic, as listed in x86_mnemonic.inc. */
+typedef struct x86_insn_info_t
+{
+    uint8_t flow;           /* control flow class, enum x86_flow_class */
+    uint8_t attr;           /* enum x86_insn_attr */
+    uint16_t regs_read;     /* implicit registers read, enum x86_regset */
+    uint16_t regs_written;  /* implicit registers written */
+    uint16_t flags_read;    /* flags read, enum x86_flag */
+    uint16_t flags_written; /* flags written or left undefined */
+} x86_insn_info_t;
+
+/* Table of mnemonic semantics, indexed by enum x86_insn_mnemonic. The entries
+ * for I_NONE and I_XXXX are all zero.
+ */
+extern const x86_insn_info_t x86_insn_info[I_XXXX + 1];
+
+/* Returns in _regs_read_ and _regs_written_ the registers that a decoded
+ * instruction accesses implicitly (enum x86_regset). This is the entry in
+ * x86_insn_info[] plus the registers that only some forms of the mnemonic
+ * access, such as DX for a 16-bit MUL, which the per-mnemonic entry does not
+ * list.
+ */
+void x86_insn_regs(
+    const x86_insn_t *insn,
+    uint16_t *regs_read,
+    uint16_t *regs_written);
+
+/* Computes the length of an instruction without decoding its operands. 
+ * Returns the number of bytes in the instruction, or -1 if the bytes do not
+ * form a valid instruction; this is always the same value that x86_decode()
+ * returns. If _flow_ is not NULL, it receives the control flow class of the
+ * instruction (enum x86_flow_class), so that the caller only needs to fully
+ * decode branch instructions.
+ */
+int x86_insn_length(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    const x86_options_t *opt,
+    int *flow);
+
+/* Maximum length of an instruction accepted by the processor. */
+#define X86_MAX_INSN_LENGTH 15
+
+/* Computes the length of the instruction starting at every byte offset in
+ * the code, as used for superset disassembly and gap scanning. For each
+ * offset _i_, lengths[i] receives the value x86_insn_length() would return,
+ * except that an instruction longer than X86_MAX_INSN_LENGTH (which takes a
+ * run of redundant prefixes) is invalid. If _flows_ is not NULL, flows[i]
+ * receives the flow class, or X86_FLOW_NONE if the instruction is invalid.
+ * Both arrays must hold (code_end - code_begin) elements. In 16-bit mode,
+ * once x86_length_table_init() has been called, the lengths of unprefixed
+ * one-byte opcodes come from an (opcode, ModR/M) lookup table instead of the
+ * decoder.
+ */
+void x86_superset_length(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    const x86_options_t *opt,
+    signed char *lengths,
+    unsigned char *flows);
+
+/* Builds the (opcode, ModR/M) length table used by x86_superset_length().
+ * The table is not built lazily, because x86_superset_length() may be
+ * called from several threads; call this function once, before starting
+ * any thread that uses it. Later calls do nothing.
+ */
+void x86_length_table_init(void);
+
+/* Reasons for which the decoder rejects an instruction. */
+enum x86_decode_failure
+{
+    X86_FAIL_MODE       = 0,    /* cpu word size not supported */
+    X86_FAIL_OPCODE     = 1,    /* opcode (or opcode extension) undefined */
+    X86_FAIL_OPERAND    = 2,    /* operand not allowed or not supported */
+    X86_FAIL_TRUNCATED  = 3,    /* instruction extends past the end of code */
+    X86_FAIL_COUNT      = 4
+};
+
+/* Hit counters of the decoder. Every instruction passed to x86_decode(),
+ * x86_insn_length(), x86_decode_batch(), x86_decode_packed() or
+ * x86_superset_length() counts as one decode, including those rejected for
+ * an unsupported mode or an offset past the end of the code. Instructions
+ * whose length x86_superset_length() takes from its lookup table only count
+ * towards _decodes_, _opcode_ and the X86_FAIL_TRUNCATED failure; the other
+ * counters only see instructions that go through the decoder. The counters
+ * are only collected if the library is compiled with X86_DECODE_STATS
+ * defined; they are not thread-safe.
+ */
+typedef struct x86_decode_stats_t
+{
+    unsigned long decodes;          /* instructions decoded, valid or not */
+    unsigned long opcode[256];      /* hits per opcode byte after prefixes */
+    unsigned long ext[16];          /* hits per opcode extension group */
+    unsigned long operand[256];     /* hits per operand spec */
+    unsigned long failure[X86_FAIL_COUNT]; /* rejects per failure reason */
+} x86_decode_stats_t;
+
+/* Returns the decoder hit counters, or NULL if they are not compiled in. */
+const x86_decode_stats_t *x86_get_decode_stats(void);
+
+/* Clears the decoder hit counters. */
+void x86_reset_decode_stats(void);
+
+/* Prints the non-zero decoder hit counters to stdout. */
+void x86_dump_decode_stats(void);
+
+/* Builds the kind of a packed operand from its type and size. */
+#define X86_OPR_KIND(type, size) (((type) << 4) | (size))
+
+/* Gets the type (enum x86_opr_type) of a packed operand kind. */
+#define X86_OPR_KIND_TYPE(kind) (((kind) >> 4) & 0xf)
+
+/* Gets the size (enum x86_opr_size) of a packed operand kind. */
+#define X86_OPR_KIND_SIZE(kind) ((kind) & 0xf)
+
+/*
+ * An operand is packed into a kind byte and a 64-bit payload. The payload
+ * depends on the operand type:
+ *
+ *   OPR_REG   register identifier in bits 0-15
+ *   OPR_IMM   immediate in bits 0-31
+ *   OPR_REL   relative offset in bits 0-31 (sign-extend when unpacking)
+ *   OPR_PTR   offset in bits 0-31, segment in bits 32-47
+ *   OPR_MEM   displacement in bits 0-31, base register in bits 32-43,
+ *             index register in bits 44-55, segment register number + 1
+ *             (0 for the default segment) in bits 56-59, and scaling
+ *             factor in bits 60-63. Registers are stored without their
+ *             offset field, which is always zero for an address register.
+ */
+#define X86_MEM_DISP(data)    ((int32_t)(uint32_t)(data))
+#define X86_MEM_BASE(data)    ((x86_reg_t)(((data) >> 32) & 0xfff))
+#define X86_MEM_INDEX(data)   ((x86_reg_t)(((data) >> 44) & 0xfff))
+#define X86_MEM_SEGMENT(data) ((unsigned int)(((data) >> 56) & 0xf))
+#define X86_MEM_SCALING(data) ((unsigned int)(((data) >> 60) & 0xf))
+
+/* Packs an operand. Stores the payload in _data_ and returns the kind. */
+unsigned char x86_pack_operand(const x86_opr_t *opr, uint64_t *data);
+
+/* Unpacks an operand previously packed by x86_pack_operand(). */
+void x86_unpack_operand(unsigned char kind, uint64_t data, x86_opr_t *opr);
+
+/**
+ * Structure-of-arrays output of x86_decode_batch(). Each column is supplied
+ * by the caller and must have room for the number of instructions decoded;
+ * the operand columns take MAX_OPERANDS entries per instruction, and unused
+ * operands have a kind of zero (OPR_NONE). Any column other than _length_
+ * may be NULL if the caller does not need it.
+ */
+typedef struct x86_insn_batch_t
+{
+    uint8_t  *length;           /* bytes in the instruction, at most
+                                 * X86_MAX_INSN_LENGTH; 0 if invalid */
+    uint16_t *mnemonic;         /* enum x86_insn_mnemonic */
+    x86_insn_prefix_t *prefix;  /* instruction prefix */
+    uint8_t  *opr_kind;         /* operand kind, see X86_OPR_KIND() */
+    uint64_t *opr_data;         /* packed operand payload */
+} x86_insn_batch_t;
+
+/* Decodes the instructions that start at each of the _n_ offsets (relative
+ * to code_begin) into the columns of _out_. An instruction that cannot be
+ * decoded gets a length of zero and a mnemonic of I_NONE. So does an
+ * instruction longer than X86_MAX_INSN_LENGTH (which takes a run of
+ * redundant prefixes), which x86_decode() accepts; callers that must
+ * handle such an instruction can decode it again with x86_decode().
+ * Returns the number of instructions successfully decoded.
+ */
+size_t x86_decode_batch(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    const size_t offsets[],
+    size_t n,
+    x86_insn_batch_t *out,
+    const x86_options_t *opt);
+
+/* Rebuilds the i-th instruction of a batch as an x86_insn_t. */
+void x86_batch_get(const x86_insn_batch_t *batch, size_t i, x86_insn_t *insn);
+
+/**
+ * Compact representation of a decoded instruction, which takes 24 bytes
+ * instead of the 100 or so bytes of an x86_insn_t. The operands are packed
+ * as by x86_pack_operand(), and their payloads are stored back to back in
+ * _data_ (little-endian), each taking only as many bytes as its kind needs:
+ *
+ *   OPR_REG   2 bytes
+ *   OPR_IMM   1, 2 or 4 bytes, depending on the operand size
+ *   OPR_REL   1, 2 or 4 bytes, depending on the operand size
+ *   OPR_PTR   6 bytes
+ *   OPR_MEM   8 bytes
+ *
+ * The prefix, mnemonic and operand kinds can be read directly; use
+ * x86_packed_operand() to expand a single operand, or x86_insn_unpack() to
+ * expand the whole instruction.
+ */
+typedef struct x86_insn_packed_t
+{
+    x86_insn_prefix_t pfx;          /* instruction prefix */
+    uint16_t op;                    /* enum x86_insn_mnemonic */
+    uint8_t  kind[MAX_OPERANDS];    /* operand kinds; 0 if not used */
+    uint8_t  data[16];              /* operand payloads */
+} x86_insn_packed_t;
+
+/* Packs an instruction. Returns non-zero if successful, or 0 if the operand
+ * payloads do not fit in the packed representation.
+ */
+int x86_insn_pack(const x86_insn_t *insn, x86_insn_packed_t *packed);
+
+/* Expands a packed instruction. */
+void x86_insn_unpack(const x86_insn_packed_t *packed, x86_insn_t *insn);
+
+/* Expands the i-th operand of a packed instruction. */
+void x86_packed_operand(const x86_insn_packed_t *packed, int i, x86_opr_t *opr);
+
+/* Decodes an instruction and packs it, like x86_decode() followed by
+ * x86_insn_pack(). The instruction is decoded into a scratch x86_insn_t on
+ * the stack, which is not cleared first, so the call is cheaper than the
+ * two steps but still goes through the unpacked form. Returns the number
+ * of bytes consumed, or -1 if the instruction is invalid or cannot be
+ * packed.
+ */
+int x86_decode_packed(
+    const unsigned char *code_begin,
+    const unsigned char *code_end,
+    x86_insn_packed_t *packed,
+    const x86_options_t *opt);
+
 #define X86_FMT_SYNTAX(f) ((f) & 1)
 #define X86_FMT_INTEL   0
 #define X86_FMT_ATT     1
@@ -543,12 +824,73 @@ int x86_decode(
 
 typedef unsigned int x86_fmt_t;
 
+/* Size of a buffer that can hold any formatted instruction. */
+#define X86_FORMAT_BUFSIZE 256
+
 /* Formats an instruction as a string. */
 void x86_format(
     const x86_insn_t *insn,
     char buffer[256],
     x86_fmt_t fmt);
 
+/* Formats an instruction into a buffer of _size_ bytes, and returns the
+ * length of the text, not counting the terminating NUL. If the text does not
+ * fit, it is truncated to (size - 1) bytes and the return value is _size_
+ * or more, as with snprintf(). A buffer of X86_FORMAT_BUFSIZE bytes or more
+ * is written in place without any intermediate copy.
+ */
+size_t x86_format_insn(
+    const x86_insn_t *insn,
+    char *buffer,
+    size_t size,
+    x86_fmt_t fmt);
+
+/* Maximum size of a label, including the terminating NUL. */
+#define X86_LABEL_BUFSIZE 32
+
+/* Resolves the linear address of a branch target or far pointer to a
+ * label. Writes the label, which is not NUL-terminated, to _buffer_ and
+ * returns its length, which must be less than X86_LABEL_BUFSIZE. Returns
+ * zero if the address has no label.
+ */
+typedef size_t (*x86_label_fn)(void *arg, uint32_t address, char *buffer);
+
+/* Supplies labels to x86_format_symbolic(). */
+typedef struct x86_symbolizer_t
+{
+    x86_label_fn label; /* callback that resolves an address */
+    void *arg;          /* argument passed to the callback */
+} x86_symbolizer_t;
+
+/* Formats an instruction like x86_format_insn(), except that relative
+ * branch targets and far pointers that resolve to a label are written as
+ * the label. The instruction is at offset _ip_ in the code segment whose
+ * linear address is _base_, and is _length_ bytes long; a relative target
+ * is base + ((ip + length + rel) mod 64K), wrapping inside the segment as
+ * the processor does. Labels are written as supplied, regardless of
+ * X86_FMT_CASE.
+ */
+size_t x86_format_symbolic(
+    const x86_insn_t *insn,
+    uint32_t base,
+    uint16_t ip,
+    int length,
+    const x86_symbolizer_t *sym,
+    char *buffer,
+    size_t size,
+    x86_fmt_t fmt);
+
+/* Returns the upper-case name of a register, or "INVALID" if it is not a
+ * register. If _len_ is not NULL, it receives the length of the name.
+ */
+const char *x86_reg_name(x86_reg_t reg, size_t *len);
+
+/* Returns the upper-case name of a mnemonic (enum x86_insn_mnemonic), or
+ * "INVALID" if it is out of range. If _len_ is not NULL, it receives the
+ * length of the name.
+ */
+const char *x86_mnemonic_name(int op, size_t *len);
+
 #ifdef __cplusplus
 }
 #endif